@@ -30,6 +30,23 @@ Type random_in_range(Type start, Type end)
 // warning about unused parameters on operations you haven't yet implemented.)
 
 Datastructures::Datastructures()
+    : alphabeticalIndex([this](StringHandle a, StringHandle b){
+          const std::string& name1 = names.str(affiliationStruct.allAffiliations[a]->name);
+          const std::string& name2 = names.str(affiliationStruct.allAffiliations[b]->name);
+          // Same names are ordered by handle, so every affiliation is listed
+          if(name1!=name2){
+              return name1 < name2;
+          }
+          return a < b;
+      }),
+      distanceIndex([this](StringHandle a, StringHandle b){
+          // Squared distances are exact, ties by y and then x like Coord's <
+          Coord c1 = affiliationStruct.allAffiliations[a]->coord;
+          Coord c2 = affiliationStruct.allAffiliations[b]->coord;
+          SquaredDistance dist1 = squaredDistance(c1, {0, 0});
+          SquaredDistance dist2 = squaredDistance(c2, {0, 0});
+          return std::tie(dist1, c1.y, c1.x, a) < std::tie(dist2, c2.y, c2.x, b);
+      })
 {
     // Write any initialization you need here
     //Affiliations *affiliationStruct = new Affiliations();
@@ -37,10 +54,7 @@ Datastructures::Datastructures()
 
 Datastructures::~Datastructures()
 {
-    for(auto& i:affiliationStruct.allAffiliations){
-        delete i.second;
-        i.second = nullptr;
-    }
+    // Slab destroys the affiliations
 }
 
 bool Datastructures::findPublication(PublicationID id){
@@ -53,7 +67,22 @@ bool Datastructures::findPublication(PublicationID id){
     }
 }
 bool Datastructures::affiliationExists(AffiliationID id){
-    return affiliationStruct.allAffiliations.find(id)!=affiliationStruct.allAffiliations.end();
+    return findAffiliation(id)!=nullptr;
+}
+Affiliation* Datastructures::findAffiliation(AffiliationID id){
+    StringHandle handle = affiliationIDs.find(id);
+    if(handle==NO_HANDLE){
+        return nullptr;
+    }
+    return affiliationStruct.allAffiliations[handle];
+}
+std::vector<AffiliationID> Datastructures::toIDs(std::vector<StringHandle> const& handles){
+    std::vector<AffiliationID> ids;
+    ids.reserve(handles.size());
+    for(auto i : handles){
+        ids.push_back(affiliationIDs.str(i));
+    }
+    return ids;
 }
 
 unsigned int Datastructures::get_affiliation_count()
@@ -63,39 +92,58 @@ unsigned int Datastructures::get_affiliation_count()
 
 void Datastructures::clear_all()
 {
-    for(auto& i:affiliationStruct.allAffiliations){
-        delete i.second;
-        i.second = nullptr;
-    }
+    affiliationStruct.storage.reset();
     affiliationStruct.allAffiliations.clear();
-    nameMap.clear();
-    IDvector.clear();
+    alphabeticalIndex.clear();
+    distanceIndex.clear();
     affiliationStruct.coordIDPair.clear();
-    sortedAffiliations.clear();
+    affiliationStruct.grid.clear();
 
     affiliationStruct.size=0;
     allPublications.clear();
+    referenceForest.clear();
+    lineageStale = false;
+    affiliationIDs.clear();
+    names.clear();
 }
 
 std::vector<AffiliationID> Datastructures::get_all_affiliations()
 {
     std::vector<AffiliationID> aha;
-    aha.reserve(affiliationStruct.allAffiliations.size());
+    aha.reserve(affiliationStruct.size);
     for(const auto &i : affiliationStruct.allAffiliations){
-        aha.push_back(i.first);
+        if(i!=nullptr){
+            aha.push_back(affiliationIDs.str(i->affiliationid));
+        }
     }
     return aha;
 }
 
+void Datastructures::for_each_affiliation(std::function<void(const AffiliationID&)> const& visitor)
+{
+    for(const auto &i : affiliationStruct.allAffiliations){
+        if(i!=nullptr){
+            visitor(affiliationIDs.str(i->affiliationid));
+        }
+    }
+}
+
 bool Datastructures::add_affiliation(AffiliationID id, const Name &name, Coord xy)
 {
     if(affiliationExists(id)){
         return false;
     }
     else{
-        affiliationStruct.allAffiliations.insert({id, new Affiliation{id, name, xy}});
-        nameMap.insert({name, id});
-        affiliationStruct.coordIDPair.insert({xy, id});
+        StringHandle handle = affiliationIDs.intern(id);
+        StringHandle nameHandle = names.intern(name);
+        if(handle==affiliationStruct.allAffiliations.size()){
+            affiliationStruct.allAffiliations.push_back(nullptr);
+        }
+        affiliationStruct.allAffiliations[handle] = affiliationStruct.storage.create(handle, nameHandle, xy);
+        alphabeticalIndex.insert(handle);
+        distanceIndex.insert(handle);
+        affiliationStruct.coordIDPair.insert({xy, handle});
+        affiliationStruct.grid.insert(xy, handle);
         affiliationStruct.size+=1;
         return true;
     }
@@ -104,7 +152,7 @@ bool Datastructures::add_affiliation(AffiliationID id, const Name &name, Coord x
 Name Datastructures::get_affiliation_name(AffiliationID id)
 {
     if(affiliationExists(id)){
-        return affiliationStruct.allAffiliations.at(id)->name;
+        return names.str(findAffiliation(id)->name);
     }
     return NO_NAME;
 }
@@ -112,7 +160,7 @@ Name Datastructures::get_affiliation_name(AffiliationID id)
 Coord Datastructures::get_affiliation_coord(AffiliationID id)
 {
     if(affiliationExists(id)){
-        return affiliationStruct.allAffiliations.at(id)->coord;
+        return findAffiliation(id)->coord;
     }
     return NO_COORD;
 
@@ -120,39 +168,28 @@ Coord Datastructures::get_affiliation_coord(AffiliationID id)
 
 std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically()
 {
+    return toIDs(alphabeticalIndex.range(0, affiliationStruct.size));
+}
 
-    // Avoid reallocations by reserving the space
-    if(IDvector.size()==0){
-        IDvector.reserve(nameMap.size());
-        for(const auto &i:nameMap){
-            IDvector.push_back(i.second);
-        }
-        return IDvector;
-    }
-    return IDvector;
+std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically(unsigned int offset, unsigned int limit)
+{
+    return toIDs(alphabeticalIndex.range(offset, limit));
 }
 
 std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing()
 {
-    if (sortedAffiliations.size() != affiliationStruct.coordIDPair.size()) {
-        sortedAffiliations.clear(); // Clear the vector if it's not the right size
-
-        sortedAffiliations.reserve(affiliationStruct.coordIDPair.size());
-        std::transform(affiliationStruct.coordIDPair.begin(),
-                       affiliationStruct.coordIDPair.end(),
-                       std::back_inserter(sortedAffiliations),
-                       [](const auto& pair) {
-                           return pair.second;
-                       });
-    }
+    return toIDs(distanceIndex.range(0, affiliationStruct.size));
+}
 
-    return sortedAffiliations;
+std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing(unsigned int offset, unsigned int limit)
+{
+    return toIDs(distanceIndex.range(offset, limit));
 }
 
 AffiliationID Datastructures::find_affiliation_with_coord(Coord xy)
 {
     if(affiliationStruct.coordIDPair.count(xy)==1){
-        return affiliationStruct.coordIDPair.at(xy);
+        return affiliationIDs.str(affiliationStruct.coordIDPair.at(xy));
     }
     return NO_AFFILIATION;
 }
@@ -160,14 +197,22 @@ AffiliationID Datastructures::find_affiliation_with_coord(Coord xy)
 bool Datastructures::change_affiliation_coord(AffiliationID id, Coord newcoord)
 {
     if(affiliationExists(id)){
-        if(affiliationStruct.allAffiliations.at(id)->coord==newcoord){
+        Affiliation* affiliation = findAffiliation(id);
+        if(affiliation->coord==newcoord){
             return true;
         }
-        auto key = affiliationStruct.allAffiliations.at(id)->coord;
-        affiliationStruct.coordIDPair.erase(key);
-        affiliationStruct.coordIDPair.insert({newcoord, id});
-        affiliationStruct.allAffiliations.at(id)->coord = newcoord;
-        sortedAffiliations.clear();
+        auto key = affiliation->coord;
+        // Another affiliation may own the entry of the old coordinate
+        auto coordIter = affiliationStruct.coordIDPair.find(key);
+        if(coordIter!=affiliationStruct.coordIDPair.end() && coordIter->second==affiliation->affiliationid){
+            affiliationStruct.coordIDPair.erase(coordIter);
+        }
+        affiliationStruct.coordIDPair.insert({newcoord, affiliation->affiliationid});
+        affiliationStruct.grid.erase(key, affiliation->affiliationid);
+        affiliationStruct.grid.insert(newcoord, affiliation->affiliationid);
+        distanceIndex.erase(affiliation->affiliationid);
+        affiliation->coord = newcoord;
+        distanceIndex.insert(affiliation->affiliationid);
         return true;
     }
     return false;
@@ -179,11 +224,24 @@ bool Datastructures::add_publication(PublicationID id, const Name &name, Year ye
     if((findPublication(id))){
         return false;
     }
-    allPublications.insert({id, {id, name, year, affiliations}});
-    publicationYearMap.insert({id, year});
+    // Every affiliation is checked before anything is changed
+    std::vector<Affiliation*> found;
+    found.reserve(affiliations.size());
     for(auto const &i : affiliations){
-        affiliationStruct.allAffiliations.at(i)->publications.push_back(id);
+        Affiliation* affiliation = findAffiliation(i);
+        if(affiliation==nullptr){
+            return false;
+        }
+        found.push_back(affiliation);
+    }
+    std::vector<StringHandle> handles;
+    handles.reserve(found.size());
+    for(auto affiliation : found){
+        insertPublication(affiliation, year, id);
+        handles.push_back(affiliation->affiliationid);
     }
+    Publication &publication = allPublications.insert({id, {id, name, year, std::move(handles)}}).first->second;
+    publication.slot = referenceForest.add(id);
 
     return true;
 
@@ -218,17 +276,38 @@ Year Datastructures::get_publication_year(PublicationID id)
 std::vector<AffiliationID> Datastructures::get_affiliations(PublicationID id)
 {
     if(findPublication(id)){
-        return allPublications.at(id).affiliations;
+        return toIDs(allPublications.at(id).affiliations);
     }
     std::vector<AffiliationID> ihaa = {NO_AFFILIATION};
     return ihaa;
 }
 
+bool Datastructures::for_each_affiliation_of(PublicationID id, std::function<void(const AffiliationID&)> const& visitor)
+{
+    if(findPublication(id)){
+        for(auto i : allPublications.at(id).affiliations){
+            visitor(affiliationIDs.str(i));
+        }
+        return true;
+    }
+    return false;
+}
+
 bool Datastructures::add_reference(PublicationID id, PublicationID parentid)
 {
     if(findPublication(id) && findPublication(parentid)){
-        allPublications.at(parentid).references.push_back(id);
-        allPublications.at(id).parent = std::make_shared<Publication>(allPublications.at(parentid));
+        unsigned int slot = allPublications.at(id).slot;
+        // Only a new leaf can be linked right away, otherwise depths below change
+        bool leaf = referenceForest.parent[slot]==ReferenceForest::NO_SLOT
+                && referenceForest.firstChild[slot]==ReferenceForest::NO_SLOT;
+        // A publication that already has a referencer moves to the new one
+        referenceForest.link(slot, allPublications.at(parentid).slot);
+        if(leaf && !lineageStale){
+            linkLineage(slot);
+        }
+        else{
+            lineageStale = true;
+        }
         return true;
     }
     return false;
@@ -237,17 +316,34 @@ bool Datastructures::add_reference(PublicationID id, PublicationID parentid)
 std::vector<PublicationID> Datastructures::get_direct_references(PublicationID id)
 {
     if(findPublication(id)){
-        return allPublications.at(id).references;
+        std::vector<PublicationID> references;
+        for_each_direct_reference(id, [&references](PublicationID reference){
+            references.push_back(reference);
+        });
+        return references;
     }
     std::vector<PublicationID> hmm = {NO_PUBLICATION};
     return hmm;
 }
 
+bool Datastructures::for_each_direct_reference(PublicationID id, std::function<void(PublicationID)> const& visitor)
+{
+    if(findPublication(id)){
+        unsigned int slot = allPublications.at(id).slot;
+        for(unsigned int child = referenceForest.firstChild[slot]; child!=ReferenceForest::NO_SLOT; child = referenceForest.nextSibling[child]){
+            visitor(referenceForest.ids[child]);
+        }
+        return true;
+    }
+    return false;
+}
+
 bool Datastructures::add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid)
 {
-    if(findPublication(publicationid)){
-        allPublications.at(publicationid).affiliations.push_back(affiliationid);
-        affiliationStruct.allAffiliations.at(affiliationid)->publications.push_back(publicationid);
+    if(findPublication(publicationid) && affiliationExists(affiliationid)){
+        Affiliation* affiliation = findAffiliation(affiliationid);
+        allPublications.at(publicationid).affiliations.push_back(affiliation->affiliationid);
+        insertPublication(affiliation, allPublications.at(publicationid).releaseYear, publicationid);
         return true;
     }
     return false;
@@ -257,7 +353,11 @@ bool Datastructures::add_affiliation_to_publication(AffiliationID affiliationid,
 std::vector<PublicationID> Datastructures::get_publications(AffiliationID id)
 {
     if(affiliationExists(id)){
-        return affiliationStruct.allAffiliations.at(id)->publications;
+        std::vector<PublicationID> publications;
+        for(auto const &i : findAffiliation(id)->publications){
+            publications.push_back(i.second);
+        }
+        return publications;
     }
     std::vector<PublicationID> aha = {NO_PUBLICATION};
     return aha;
@@ -266,47 +366,53 @@ std::vector<PublicationID> Datastructures::get_publications(AffiliationID id)
 PublicationID Datastructures::get_parent(PublicationID id)
 {
     if(findPublication(id)){
-        if(allPublications.at(id).parent!=nullptr){
-              return allPublications.at(id).parent->id;
+        unsigned int parent = referenceForest.parent[allPublications.at(id).slot];
+        if(parent!=ReferenceForest::NO_SLOT){
+              return referenceForest.ids[parent];
         }
     }
     return NO_PUBLICATION;
 }
+void Datastructures::insertPublication(Affiliation* affiliation, Year year, PublicationID id){
+    auto &publications = affiliation->publications;
+    std::pair<Year, PublicationID> key = {year, id};
+    publications.insert(std::upper_bound(publications.begin(), publications.end(), key), key);
+}
+
 std::vector<std::pair<Year, PublicationID> > Datastructures::get_publications_after(AffiliationID affiliationid, Year year)
 {
     // Check that the map contains the affiliationID
     if(affiliationExists(affiliationid)){
-        std::vector<std::pair<Year, PublicationID> > p;
-
-        for(auto i : affiliationStruct.allAffiliations.at(affiliationid)->publications){
-            if(publicationYearMap.at(i)>=year){
-                p.push_back({allPublications.at(i).releaseYear, allPublications.at(i).id});
-            }
-        }
-        std::sort(p.begin(), p.end(), [](auto i, auto j){
-            if(i.first!=j.first){
-                return i.first<j.first;
-            }
-            else{
-                return i.second<j.second;
-            }
-        });
-        return p;
+        auto const &publications = findAffiliation(affiliationid)->publications;
+        // Publications are in (year, id) order, so the result is the tail from the first one of the year
+        auto first = std::lower_bound(publications.begin(), publications.end(), std::make_pair(year, PublicationID(0)));
+        return std::vector<std::pair<Year, PublicationID> >(first, publications.end());
     }
     std::vector<std::pair<Year, PublicationID> > lul = {{NO_YEAR, NO_PUBLICATION}};
     return lul;
 }
 
+bool Datastructures::for_each_publication_after(AffiliationID affiliationid, Year year, std::function<void(Year, PublicationID)> const& visitor)
+{
+    if(affiliationExists(affiliationid)){
+        auto const &publications = findAffiliation(affiliationid)->publications;
+        auto first = std::lower_bound(publications.begin(), publications.end(), std::make_pair(year, PublicationID(0)));
+        for(auto it = first; it != publications.end(); ++it){
+            visitor(it->first, it->second);
+        }
+        return true;
+    }
+    return false;
+}
+
 std::vector<PublicationID> Datastructures::get_referenced_by_chain(PublicationID id)
 {
     if(findPublication(id)){
         std::vector<PublicationID> publi;
-
-        while(id!=NO_PUBLICATION){
-            id = get_parent(id);
-            if(id!=NO_PUBLICATION){
-                publi.push_back(id);
-            }
+        unsigned int slot = referenceForest.parent[allPublications.at(id).slot];
+        while(slot!=ReferenceForest::NO_SLOT){
+            publi.push_back(referenceForest.ids[slot]);
+            slot = referenceForest.parent[slot];
         }
         return publi;
     }
@@ -314,25 +420,14 @@ std::vector<PublicationID> Datastructures::get_referenced_by_chain(PublicationID
     return publi1;
 }
 
-std::vector<PublicationID> Datastructures::referencesRecursively(std::vector<PublicationID> &publications, PublicationID id){
-    id = allPublications.at(id).id;
-    for(const auto &i: allPublications.at(id).references){
-        if((allPublications.at(id).references.size()!=0)){
-            id = i;
-            publications.insert(publications.begin(), allPublications.at(i).references.begin(), allPublications.at(i).references.end());
-            referencesRecursively(publications, id);
-        }
-    }
-    return publications;
-}
 std::vector<PublicationID> Datastructures::get_all_references(PublicationID id)
 {
-    // USE RECURSION
     if(findPublication(id)){
         std::vector<PublicationID> references;
-        references.reserve(allPublications.at(id).references.size());
-        references.insert(references.begin(), allPublications.at(id).references.begin(), allPublications.at(id).references.end());
-        referencesRecursively(references, id);
+        // The forest links are followed without recursion, deep chains don't overflow the call stack
+        referenceForest.forEachBelow(allPublications.at(id).slot, [&](unsigned int slot){
+            references.push_back(referenceForest.ids[slot]);
+        });
         return references;
     }
     std::vector<PublicationID> notFound = {NO_PUBLICATION};
@@ -340,134 +435,555 @@ std::vector<PublicationID> Datastructures::get_all_references(PublicationID id)
 }
 std::vector<AffiliationID> Datastructures::get_affiliations_closest_to(Coord xy)
 {
-    if(affiliationStruct.allAffiliations.size()>0){
-        std::map<int, AffiliationID> IDs;
+    // Grid orders equal distances by the smaller y coordinate
+    return toIDs(affiliationStruct.grid.nearest(xy, 3));
+}
 
-        // Since it 3 closes coordinates will be picked, we can iterate from [lower_bound-3, lower_bound+3]
-        // because the coordinates have to be in that range (since they are sorted)
-        auto it = affiliationStruct.coordIDPair.lower_bound(xy);
+bool Datastructures::remove_affiliation(AffiliationID id)
+{
+    if(!(affiliationExists(id))){
+        return false;
+    }
+    StringHandle handle = affiliationIDs.find(id);
+    Affiliation* affiliation = affiliationStruct.allAffiliations[handle];
+    // Only the affiliation's own publications refer to it
+    for(auto const &i : affiliation->publications){
+        auto &affiliations = allPublications.at(i.second).affiliations;
+        affiliations.erase(std::remove(affiliations.begin(), affiliations.end(), handle), affiliations.end());
+    }
+    auto coordIter = affiliationStruct.coordIDPair.find(affiliation->coord);
+    if(coordIter!=affiliationStruct.coordIDPair.end() && coordIter->second==handle){
+        affiliationStruct.coordIDPair.erase(coordIter);
+    }
+    affiliationStruct.grid.erase(affiliation->coord, handle);
+    alphabeticalIndex.erase(handle);
+    distanceIndex.erase(handle);
+    affiliationStruct.storage.destroy(affiliation);
+    affiliationStruct.allAffiliations[handle] = nullptr;
+    affiliationStruct.size-=1;
+    return true;
+}
 
-        auto itt = std::distance(affiliationStruct.coordIDPair.begin(), it);
+void Datastructures::linkLineage(unsigned int slot){
+    auto &depth = referenceForest.depth;
+    auto &jump = referenceForest.jump;
+    unsigned int parent = referenceForest.parent[slot];
+    if(parent==ReferenceForest::NO_SLOT){
+        depth[slot] = 0;
+        jump[slot] = slot;
+        return;
+    }
+    unsigned int parentJump = jump[parent];
+    depth[slot] = depth[parent]+1;
+    // Two jumps of the same length above the parent are combined into one,
+    // which keeps every ancestor O(log(d)) jumps away
+    if(depth[parent]-depth[parentJump] == depth[parentJump]-depth[jump[parentJump]]){
+        jump[slot] = jump[parentJump];
+    }
+    else{
+        jump[slot] = parent;
+    }
+}
 
-        if(itt<3){
-            while(it!=affiliationStruct.coordIDPair.begin()){
-                --it;
-            }
+void Datastructures::rebuildLineage(){
+    // Parents are linked before their references
+    for(unsigned int root = 0; root < referenceForest.ids.size(); ++root){
+        if(referenceForest.ids[root]!=NO_PUBLICATION && referenceForest.parent[root]==ReferenceForest::NO_SLOT){
+            linkLineage(root);
+            referenceForest.forEachBelow(root, [this](unsigned int slot){
+                linkLineage(slot);
+            });
         }
-        while(it!=affiliationStruct.coordIDPair.end()){
-            int distance = sqrt(std::pow(it->first.x-xy.x,2) + std::pow(it->first.y-xy.y,2));
-            if(IDs.size()<3){
-                IDs.insert({distance, it->second});
-            }
-            else{
-                for(auto itr = IDs.begin(); itr!=IDs.end();){
-                    if(distance < itr->first){
-                        IDs.erase(itr);
-                        IDs.insert({distance, it->second});
-                        break;
-                    }
-                    else{
-                        ++itr;
-                    }
-                }
-            }
-            ++it;
+    }
+    lineageStale = false;
+}
+
+unsigned int Datastructures::commonAncestor(unsigned int slot1, unsigned int slot2){
+    if(lineageStale){
+        rebuildLineage();
+    }
+    auto const &depth = referenceForest.depth;
+    auto const &jump = referenceForest.jump;
+    auto const &parent = referenceForest.parent;
+    if(depth[slot1] < depth[slot2]){
+        std::swap(slot1, slot2);
+    }
+    while(depth[slot1] > depth[slot2]){
+        slot1 = depth[jump[slot1]] >= depth[slot2] ? jump[slot1] : parent[slot1];
+    }
+    // Jump lengths depend only on the depth, so both stay on the same level
+    while(slot1 != slot2){
+        if(depth[slot1]==0){
+            return ReferenceForest::NO_SLOT;
         }
-        std::vector<AffiliationID> okay;
-        for(auto i: IDs){
-            okay.push_back(i.second);
+        if(jump[slot1] != jump[slot2]){
+            slot1 = jump[slot1];
+            slot2 = jump[slot2];
         }
-        return okay;
+        else{
+            slot1 = parent[slot1];
+            slot2 = parent[slot2];
+        }
+    }
+    return slot1;
+}
 
+PublicationID Datastructures::get_closest_common_parent(PublicationID id1, PublicationID id2)
+{
+    if(!findPublication(id1) || !findPublication(id2)){
+        return NO_PUBLICATION;
     }
-    else{
-        std::vector<AffiliationID> okay;
-        return okay;
+    unsigned int parent1 = referenceForest.parent[allPublications.at(id1).slot];
+    unsigned int parent2 = referenceForest.parent[allPublications.at(id2).slot];
+    if(parent1==ReferenceForest::NO_SLOT || parent2==ReferenceForest::NO_SLOT){
+        return NO_PUBLICATION;
+    }
+    unsigned int common = commonAncestor(parent1, parent2);
+    if(common==ReferenceForest::NO_SLOT){
+        return NO_PUBLICATION;
     }
+    return referenceForest.ids[common];
 }
 
-bool Datastructures::remove_affiliation(AffiliationID id)
+bool Datastructures::remove_publication(PublicationID publicationid)
 {
-    if(!(affiliationExists(id))){
+    if(!(findPublication(publicationid))){
         return false;
     }
-    for(auto i : allPublications){
-        auto idIter = std::find(i.second.affiliations.begin(), i.second.affiliations.end(), id);
-        if(idIter != i.second.affiliations.end()){
-            i.second.affiliations.erase(idIter);
-            break;
-        }
+    Publication &publication = allPublications.at(publicationid);
+    // The references become roots of their own trees
+    if(referenceForest.firstChild[publication.slot]!=ReferenceForest::NO_SLOT){
+        lineageStale = true;
+    }
+    referenceForest.remove(publication.slot);
+    std::pair<Year, PublicationID> key = {publication.releaseYear, publicationid};
+    for(auto i : publication.affiliations){
+        Affiliation* affiliation = affiliationStruct.allAffiliations[i];
+        auto range = std::equal_range(affiliation->publications.begin(), affiliation->publications.end(), key);
+        affiliation->publications.erase(range.first, range.second);
     }
-    delete affiliationStruct.allAffiliations.at(id);
-    affiliationStruct.allAffiliations.erase(id);
+    allPublications.erase(publicationid);
+    return true;
+}
 
-    if(std::find(IDvector.begin(), IDvector.end(), id)!=IDvector.end()){
-        IDvector.erase(std::find(IDvector.begin(), IDvector.end(), id));
+long long SpatialGrid::cellOf(int value) const{
+    // Rounds towards negative infinity also for negative coordinates
+    long long cell = value / cellSize;
+    if(value < 0 && cell * cellSize != value){
+        --cell;
     }
+    return cell;
+}
 
-    auto it = std::find(sortedAffiliations.begin(), sortedAffiliations.end(), id);
-    if(it!=sortedAffiliations.end()){
-        sortedAffiliations.erase(it);
+unsigned long long SpatialGrid::key(long long cellX, long long cellY){
+    return (static_cast<unsigned long long>(static_cast<unsigned int>(cellX)) << 32)
+            | static_cast<unsigned int>(cellY);
+}
+
+void SpatialGrid::addToCell(Coord xy, StringHandle id){
+    long long cellX = cellOf(xy.x);
+    long long cellY = cellOf(xy.y);
+    cells[key(cellX, cellY)].emplace_back(xy, id);
+
+    if(minX > maxX){
+        minX = maxX = cellX;
+        minY = maxY = cellY;
     }
-    for(auto i: affiliationStruct.coordIDPair){
-        if(i.second==id){
-            affiliationStruct.coordIDPair.erase(i.first);
-            break;
-        }
+    else{
+        minX = std::min(minX, cellX);
+        maxX = std::max(maxX, cellX);
+        minY = std::min(minY, cellY);
+        maxY = std::max(maxY, cellY);
     }
-    affiliationStruct.size-=1;
-    return true;
 }
 
-PublicationID Datastructures::get_closest_common_parent(PublicationID id1, PublicationID id2)
-{
-    std::vector<PublicationID> id1Parents = get_referenced_by_chain(id1);
-    std::vector<PublicationID> id2Parents = get_referenced_by_chain(id2);
+void SpatialGrid::insert(Coord xy, StringHandle id){
+    addToCell(xy, id);
+    ++count;
 
-    auto id1size = size_t(id1Parents.size());
-    auto id2size = size_t(id2Parents.size());
-    for(unsigned long long i = 0; i < id1size; i++){
-        for(unsigned long long j = 0; j < id2size; j++){
-            if((id1Parents.at(i)!=id1) && (id2Parents.at(j)!=id2) &&(id1Parents.at(i)==id2Parents.at(j))){
-                return id1Parents.at(i);
-            }
-        }
+    if(count > 2 * std::max(builtFor, MIN_REBUILD)){
+        rebuild();
     }
-    return NO_PUBLICATION;
 }
 
+void SpatialGrid::erase(Coord xy, StringHandle id){
+    auto cell = cells.find(key(cellOf(xy.x), cellOf(xy.y)));
+
+    if(cell == cells.end()){
+        return;
+    }
+    auto& points = cell->second;
+    auto it = std::find_if(points.begin(), points.end(), [id](const std::pair<Coord, StringHandle>& point){
+        return point.second == id;
+    });
 
+    if(it == points.end()){
+        return;
+    }
+    *it = points.back();
+    points.pop_back();
 
+    if(points.empty()){
+        cells.erase(cell);
+    }
+    --count;
 
-bool Datastructures::remove_publication(PublicationID publicationid)
-{
-    if(!(findPublication(publicationid))){
-        return false;
+    if(count * 2 < builtFor){
+        rebuild();
     }
-    for(auto i: allPublications){
-        if(std::find(i.second.references.begin(), i.second.references.end(), publicationid)!=i.second.references.end()){
-            i.second.references.erase(std::find(i.second.references.begin(), i.second.references.end(), publicationid));
+}
+
+void SpatialGrid::clear(){
+    cells.clear();
+    cellSize = 1;
+    count = 0;
+    builtFor = 0;
+    minX = minY = 0;
+    maxX = maxY = -1;
+}
+
+void SpatialGrid::rebuild(){
+    std::vector<std::pair<Coord, StringHandle>> points;
+    points.reserve(count);
+
+    long long lowX = std::numeric_limits<long long>::max();
+    long long lowY = lowX;
+    long long highX = std::numeric_limits<long long>::min();
+    long long highY = highX;
+
+    for(const auto& cell : cells){
+        for(const auto& point : cell.second){
+            points.push_back(point);
+            lowX = std::min<long long>(lowX, point.first.x);
+            highX = std::max<long long>(highX, point.first.x);
+            lowY = std::min<long long>(lowY, point.first.y);
+            highY = std::max<long long>(highY, point.first.y);
         }
+    }
+    cells.clear();
+    minX = minY = 0;
+    maxX = maxY = -1;
+    builtFor = points.size();
 
-        if(i.second.parent!=nullptr){
-            if(i.second.parent->id==publicationid){
-                i.second.parent->id = NO_PUBLICATION;
+    if(points.empty()){
+        cellSize = 1;
+        return;
+    }
+    // Side of a square holding TARGET_PER_CELL affiliations if they were spread evenly
+    double area = static_cast<double>(highX - lowX + 1) * (highY - lowY + 1);
+    cellSize = std::max(1LL, static_cast<long long>(std::sqrt(area * TARGET_PER_CELL / points.size())));
+
+    for(const auto& point : points){
+        addToCell(point.first, point.second);
+    }
+}
+
+std::vector<StringHandle> SpatialGrid::nearest(Coord xy, size_t k) const{
+    // Closest candidates so far as (squared distance, y, id), kept sorted
+    std::vector<std::tuple<SquaredDistance, int, StringHandle>> best;
+
+    auto consider = [&best, &xy, k](const std::vector<std::pair<Coord, StringHandle>>& points){
+        for(const auto& [pos, id] : points){
+            std::tuple<SquaredDistance, int, StringHandle> candidate{squaredDistance(pos, xy), pos.y, id};
+
+            if(best.size() == k && !(candidate < best.back())){
+                continue;
+            }
+            best.insert(std::upper_bound(best.begin(), best.end(), candidate), candidate);
+            if(best.size() > k){
+                best.pop_back();
             }
         }
+    };
+
+    if(count == 0 || k == 0){
+        return {};
+    }
+    long long centerX = cellOf(xy.x);
+    long long centerY = cellOf(xy.y);
+
+    // Rings of cells around the query cell, from the first one reaching the bounding box
+    long long first = std::max({0LL, minX - centerX, centerX - maxX, minY - centerY, centerY - maxY});
+    long long last = std::max({centerX - minX, maxX - centerX, centerY - minY, maxY - centerY});
+    size_t visited = 0;
+
+    for(long long ring = first; ring <= last; ++ring){
+        // Every point in this ring is at least (ring - 1) cells away, capped so the square fits
+        unsigned long long gap = std::min((ring - 1) * cellSize, 0xffffffffLL);
+        if(ring > 0 && best.size() == k && std::get<0>(best.back()) < SquaredDistance{false, gap*gap}){
+            break;
+        }
+        // Ring has more cells than are occupied, reading all cells is cheaper
+        if(visited > cells.size()){
+            best.clear();
+            for(const auto& cell : cells){
+                consider(cell.second);
+            }
+            break;
+        }
+        long long lowX = std::max(centerX - ring, minX);
+        long long highX = std::min(centerX + ring, maxX);
+        long long lowY = std::max(centerY - ring, minY);
+        long long highY = std::min(centerY + ring, maxY);
+
+        auto visit = [&](long long cellX, long long cellY){
+            ++visited;
+            auto cell = cells.find(key(cellX, cellY));
+            if(cell != cells.end()){
+                consider(cell->second);
+            }
+        };
+        for(long long cellY : {centerY - ring, centerY + ring}){
+            if(cellY >= minY && cellY <= maxY){
+                for(long long cellX = lowX; cellX <= highX; ++cellX){
+                    visit(cellX, cellY);
+                }
+            }
+            if(ring == 0){
+                break;
+            }
+        }
+        for(long long cellX : {centerX - ring, centerX + ring}){
+            if(ring == 0 || cellX < minX || cellX > maxX){
+                continue;
+            }
+            for(long long cellY = std::max(lowY, centerY - ring + 1); cellY <= std::min(highY, centerY + ring - 1); ++cellY){
+                visit(cellX, cellY);
+            }
+        }
+    }
+
+    std::vector<StringHandle> ids;
+    ids.reserve(best.size());
+    for(const auto& candidate : best){
+        ids.push_back(std::get<2>(candidate));
+    }
+    return ids;
+}
+
+unsigned int OrderedIndex::priority(StringHandle id){
+    // Hash of the handle as the heap priority
+    unsigned int h = id * 0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+unsigned int OrderedIndex::sizeOf(StringHandle node) const{
+    return node == NO_HANDLE ? 0 : sizes[node];
+}
+
+void OrderedIndex::update(StringHandle node){
+    sizes[node] = 1 + sizeOf(left[node]) + sizeOf(right[node]);
+}
+
+StringHandle OrderedIndex::merge(StringHandle lower, StringHandle upper){
+    if(lower == NO_HANDLE){
+        return upper;
+    }
+    if(upper == NO_HANDLE){
+        return lower;
+    }
+    if(priority(lower) > priority(upper)){
+        right[lower] = merge(right[lower], upper);
+        update(lower);
+        return lower;
+    }
+    left[upper] = merge(lower, left[upper]);
+    update(upper);
+    return upper;
+}
+
+void OrderedIndex::split(StringHandle tree, StringHandle id, StringHandle& lower, StringHandle& upper){
+    // Nodes ordered before id go to lower, the rest to upper
+    if(tree == NO_HANDLE){
+        lower = NO_HANDLE;
+        upper = NO_HANDLE;
+        return;
+    }
+    if(less(tree, id)){
+        split(right[tree], id, right[tree], upper);
+        lower = tree;
     }
-    if(publicationYearMap.find(publicationid)!=publicationYearMap.end()){
-        publicationYearMap.erase(publicationid);
+    else{
+        split(left[tree], id, lower, left[tree]);
+        upper = tree;
+    }
+    update(tree);
+}
+
+StringHandle OrderedIndex::eraseFrom(StringHandle tree, StringHandle id){
+    if(tree == NO_HANDLE){
+        return NO_HANDLE;
+    }
+    if(tree == id){
+        return merge(left[id], right[id]);
+    }
+    if(less(id, tree)){
+        left[tree] = eraseFrom(left[tree], id);
+    }
+    else{
+        right[tree] = eraseFrom(right[tree], id);
     }
-    if(allPublications.find(publicationid)!=allPublications.end()){
-        allPublications.erase(publicationid);
+    update(tree);
+    return tree;
+}
+
+void OrderedIndex::insert(StringHandle id){
+    if(id >= sizes.size()){
+        left.resize(id + 1, NO_HANDLE);
+        right.resize(id + 1, NO_HANDLE);
+        sizes.resize(id + 1, 0);
     }
-    for(auto i : affiliationStruct.allAffiliations){
-        if(std::find(i.second->publications.begin(), i.second->publications.end(), publicationid)!=i.second->publications.end()){
-            i.second->publications.erase(std::find(i.second->publications.begin(), i.second->publications.end(), publicationid));
+    left[id] = NO_HANDLE;
+    right[id] = NO_HANDLE;
+    sizes[id] = 1;
+
+    StringHandle lower, upper;
+    split(root, id, lower, upper);
+    root = merge(merge(lower, id), upper);
+}
+
+void OrderedIndex::erase(StringHandle id){
+    root = eraseFrom(root, id);
+}
+
+void OrderedIndex::clear(){
+    root = NO_HANDLE;
+    left.clear();
+    right.clear();
+    sizes.clear();
+}
+
+size_t OrderedIndex::size() const{
+    return sizeOf(root);
+}
+
+std::vector<StringHandle> OrderedIndex::range(size_t offset, size_t limit) const{
+    std::vector<StringHandle> result;
+
+    if(offset >= size()){
+        return result;
+    }
+    result.reserve(std::min(limit, size() - offset));
+
+    // Descend to position offset, the stack keeps the nodes still to visit in order
+    std::vector<StringHandle> stack;
+    StringHandle node = root;
+    size_t skip = offset;
+
+    while(node != NO_HANDLE){
+        size_t leftSize = sizeOf(left[node]);
+
+        if(skip < leftSize){
+            stack.push_back(node);
+            node = left[node];
+        }
+        else if(skip == leftSize){
+            stack.push_back(node);
+            break;
+        }
+        else{
+            skip -= leftSize + 1;
+            node = right[node];
         }
     }
+    while(!stack.empty() && result.size() < limit){
+        node = stack.back();
+        stack.pop_back();
+        result.push_back(node);
 
+        for(StringHandle next = right[node]; next != NO_HANDLE; next = left[next]){
+            stack.push_back(next);
+        }
+    }
+    return result;
+}
+
+unsigned int ReferenceForest::add(PublicationID id){
+    unsigned int slot;
+    if(freeSlots.empty()){
+        slot = ids.size();
+        ids.push_back(id);
+        parent.push_back(NO_SLOT);
+        firstChild.push_back(NO_SLOT);
+        lastChild.push_back(NO_SLOT);
+        nextSibling.push_back(NO_SLOT);
+        prevSibling.push_back(NO_SLOT);
+        depth.push_back(0);
+        jump.push_back(slot);
+        return slot;
+    }
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+    ids[slot] = id;
+    depth[slot] = 0;
+    jump[slot] = slot;
+    return slot;
+}
+
+void ReferenceForest::remove(unsigned int slot){
+    unsigned int child = firstChild[slot];
+    while(child!=NO_SLOT){
+        unsigned int next = nextSibling[child];
+        parent[child] = NO_SLOT;
+        nextSibling[child] = NO_SLOT;
+        prevSibling[child] = NO_SLOT;
+        child = next;
+    }
+    firstChild[slot] = NO_SLOT;
+    lastChild[slot] = NO_SLOT;
+    if(parent[slot]!=NO_SLOT){
+        unlink(slot);
+    }
+    ids[slot] = NO_PUBLICATION;
+    freeSlots.push_back(slot);
+}
+
+void ReferenceForest::link(unsigned int child, unsigned int newParent){
+    if(parent[child]!=NO_SLOT){
+        unlink(child);
+    }
+    parent[child] = newParent;
+    prevSibling[child] = lastChild[newParent];
+    if(lastChild[newParent]!=NO_SLOT){
+        nextSibling[lastChild[newParent]] = child;
+    }
+    else{
+        firstChild[newParent] = child;
+    }
+    lastChild[newParent] = child;
+}
 
-    return true;
+void ReferenceForest::unlink(unsigned int child){
+    unsigned int prev = prevSibling[child];
+    unsigned int next = nextSibling[child];
+    if(prev!=NO_SLOT){
+        nextSibling[prev] = next;
+    }
+    else{
+        firstChild[parent[child]] = next;
+    }
+    if(next!=NO_SLOT){
+        prevSibling[next] = prev;
+    }
+    else{
+        lastChild[parent[child]] = prev;
+    }
+    parent[child] = NO_SLOT;
+    prevSibling[child] = NO_SLOT;
+    nextSibling[child] = NO_SLOT;
 }
 
+void ReferenceForest::clear(){
+    ids.clear();
+    parent.clear();
+    firstChild.clear();
+    lastChild.clear();
+    nextSibling.clear();
+    prevSibling.clear();
+    depth.clear();
+    jump.clear();
+    freeSlots.clear();
+}
@@ -13,6 +13,9 @@
 #include <unordered_set>
 #include <set>
 #include <math.h>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
 // Types for IDs
 using AffiliationID = std::string;
 using PublicationID = unsigned long long int;
@@ -20,6 +23,8 @@ using Name = std::string;
 using Year = unsigned short int;
 using Weight = int;
 using Distance = int;
+// Handle of an interned string
+using StringHandle = unsigned int;
 
 // Return values for cases where required thing was not found
 AffiliationID const NO_AFFILIATION = "---";
@@ -27,6 +32,7 @@ PublicationID const NO_PUBLICATION = -1;
 Name const NO_NAME = "!NO_NAME!";
 Year const NO_YEAR = -1;
 Weight const NO_WEIGHT = -1;
+StringHandle const NO_HANDLE = std::numeric_limits<StringHandle>::max();
 
 // Return value for cases where integer values were not found
 int const NO_VALUE = std::numeric_limits<int>::min();
@@ -56,6 +62,18 @@ struct CoordHash
     }
 };
 
+// Squared distance as (carry, low 64 bits), exact even at the int limits
+using SquaredDistance = std::pair<bool, unsigned long long>;
+
+inline SquaredDistance squaredDistance(Coord c1, Coord c2)
+{
+    // Widen before subtracting, the difference can take 33 bits
+    unsigned long long dx = std::llabs(static_cast<long long>(c1.x) - c2.x);
+    unsigned long long dy = std::llabs(static_cast<long long>(c1.y) - c2.y);
+    unsigned long long sum = dx*dx + dy*dy;
+    return {sum < dx*dx, sum};
+}
+
 // Example: Defining < for Coord so that it can be used
 // as key for std::map/set
 inline bool operator<(Coord c1, Coord c2)
@@ -65,9 +83,8 @@ inline bool operator<(Coord c1, Coord c2)
     else if (c2.y < c1.y) { return false; }
     else { return c1.x < c2.x; }
     */
-    // TODO: REMOVE SQRT, UNNECESSARY
-    Distance dist1 = c1.x*c1.x+c1.y*c1.y;
-    Distance dist2 = c2.x*c2.x+c2.y*c2.y;
+    SquaredDistance dist1 = squaredDistance(c1, {0, 0});
+    SquaredDistance dist2 = squaredDistance(c2, {0, 0});
     if (dist1 < dist2){return true;}
     if (dist1 > dist2){return false;}
     if (c1.y<c2.y){return true;}
@@ -78,6 +95,109 @@ inline bool operator<(Coord c1, Coord c2)
 // Return value for cases where coordinates were not found
 Coord const NO_COORD = {NO_VALUE, NO_VALUE};
 
+// Grid of occupied cells over the affiliation coordinates, rebuilt when the count doubles or halves
+struct SpatialGrid
+{
+    static constexpr long long TARGET_PER_CELL = 2;
+    static constexpr size_t MIN_REBUILD = 8;
+
+    std::unordered_map<unsigned long long, std::vector<std::pair<Coord, StringHandle>>> cells;
+    long long cellSize = 1;
+    size_t count = 0;
+    size_t builtFor = 0;
+
+    // Bounding box of the occupied cells
+    long long minX = 0;
+    long long minY = 0;
+    long long maxX = -1;
+    long long maxY = -1;
+
+    void insert(Coord xy, StringHandle id);
+    void erase(Coord xy, StringHandle id);
+    void clear();
+    // Closest affiliations by distance, equal distances ordered by smaller y
+    std::vector<StringHandle> nearest(Coord xy, size_t k) const;
+
+private:
+    long long cellOf(int value) const;
+    static unsigned long long key(long long cellX, long long cellY);
+    void addToCell(Coord xy, StringHandle id);
+    void rebuild();
+};
+
+// Treap over affiliation handles with subtree sizes, erase before changing what less reads
+struct OrderedIndex
+{
+    std::function<bool(StringHandle, StringHandle)> less;
+    StringHandle root = NO_HANDLE;
+    std::vector<StringHandle> left;
+    std::vector<StringHandle> right;
+    std::vector<unsigned int> sizes;
+
+    explicit OrderedIndex(std::function<bool(StringHandle, StringHandle)> less) : less(std::move(less)) {}
+    void insert(StringHandle id);
+    void erase(StringHandle id);
+    void clear();
+    size_t size() const;
+    // Handles from position offset onwards in order, at most limit of them
+    std::vector<StringHandle> range(size_t offset, size_t limit) const;
+
+private:
+    static unsigned int priority(StringHandle id);
+    unsigned int sizeOf(StringHandle node) const;
+    void update(StringHandle node);
+    StringHandle merge(StringHandle lower, StringHandle upper);
+    void split(StringHandle tree, StringHandle id, StringHandle& lower, StringHandle& upper);
+    StringHandle eraseFrom(StringHandle tree, StringHandle id);
+};
+
+// Reference trees of the publications in flat arrays indexed by slot. Referencers,
+// references and siblings are linked by slot, so walking up a chain or over a subtree
+// stays inside these arrays. Slots of removed publications are reused.
+struct ReferenceForest
+{
+    static constexpr unsigned int NO_SLOT = std::numeric_limits<unsigned int>::max();
+
+    std::vector<PublicationID> ids;
+    std::vector<unsigned int> parent;
+    std::vector<unsigned int> firstChild;
+    std::vector<unsigned int> lastChild;
+    std::vector<unsigned int> nextSibling;
+    std::vector<unsigned int> prevSibling;
+    // Depth in the tree and a jump pointer to an ancestor, roots jump to themselves
+    std::vector<unsigned int> depth;
+    std::vector<unsigned int> jump;
+    std::vector<unsigned int> freeSlots;
+
+    unsigned int add(PublicationID id);
+    // The references of the slot become roots
+    void remove(unsigned int slot);
+    // Makes child the last reference of newParent, taking it from its old referencer
+    void link(unsigned int child, unsigned int newParent);
+    void clear();
+
+    // Calls func for every slot below the given one in preorder, without a stack
+    template <typename Func>
+    void forEachBelow(unsigned int slot, Func func) const
+    {
+        unsigned int current = firstChild[slot];
+        while(current!=NO_SLOT){
+            func(current);
+            if(firstChild[current]!=NO_SLOT){
+                current = firstChild[current];
+                continue;
+            }
+            while(current!=slot && nextSibling[current]==NO_SLOT){
+                current = parent[current];
+            }
+            current = current==slot ? NO_SLOT : nextSibling[current];
+        }
+    }
+
+private:
+    void unlink(unsigned int child);
+};
+
 // Return value for cases where Distance is unknown
 Distance const NO_DISTANCE = NO_VALUE;
 
@@ -97,26 +217,125 @@ private:
     std::string msg_;
 };
 
+// Every distinct string is stored once and referred to by a 32-bit handle.
+// Structs keep only handles, strings are looked up when returned.
+struct InternTable{
+    std::unordered_map<std::string, StringHandle> handles;
+    std::vector<const std::string*> strings;
+
+    StringHandle intern(std::string const& str){
+        auto [it, inserted] = handles.emplace(str, strings.size());
+        if(inserted){
+            strings.push_back(&it->first);
+        }
+        return it->second;
+    }
+    StringHandle find(std::string const& str) const{
+        auto it = handles.find(str);
+        return it==handles.end() ? NO_HANDLE : it->second;
+    }
+    std::string const& str(StringHandle handle) const{
+        return *strings[handle];
+    }
+    void clear(){
+        handles.clear();
+        strings.clear();
+    }
+};
+
 struct Publication{
     PublicationID id;
     Name title;
     Year releaseYear;
-    std::vector<AffiliationID> affiliations = {};
-    std::vector<PublicationID> references = {};
-    std::shared_ptr<Publication> parent = nullptr;
+    std::vector<StringHandle> affiliations = {};
+    // Place in the reference forest
+    unsigned int slot = ReferenceForest::NO_SLOT;
 };
 
 struct Affiliation{
-    AffiliationID affiliationid;
-    const Name name;
+    StringHandle affiliationid;
+    const StringHandle name;
     Coord coord;
-    std::vector<PublicationID> publications = {};
+    // Sorted by year and then ID, so get_publications_after is a binary search
+    std::vector<std::pair<Year, PublicationID>> publications = {};
+};
+
+// Affiliations in fixed size chunks, so their addresses stay, freed slots are reused
+template <typename Type>
+class Slab{
+public:
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    Slab() = default;
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    ~Slab(){
+        reset();
+        for(Slot* chunk : chunks){
+            delete[] chunk;
+        }
+    }
+
+    template <typename... Args>
+    Type* create(Args&&... args){
+        Slot* slot;
+        if(!freeSlots.empty()){
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else{
+            if(used==chunks.size()*CHUNK_SIZE){
+                chunks.push_back(new Slot[CHUNK_SIZE]);
+            }
+            slot = &chunks[used/CHUNK_SIZE][used%CHUNK_SIZE];
+            ++used;
+        }
+        Type* object = new (slot->storage) Type{std::forward<Args>(args)...};
+        slot->live = true;
+        return object;
+    }
+
+    void destroy(Type* object){
+        // The object is stored first in its slot
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        object->~Type();
+        slot->live = false;
+        freeSlots.push_back(slot);
+    }
+
+    // Destroys every object but keeps the chunks for refilling
+    void reset(){
+        if constexpr(!std::is_trivially_destructible_v<Type>){
+            for(size_t i = 0; i < used; ++i){
+                Slot& slot = chunks[i/CHUNK_SIZE][i%CHUNK_SIZE];
+                if(slot.live){
+                    reinterpret_cast<Type*>(slot.storage)->~Type();
+                }
+            }
+        }
+        used = 0;
+        freeSlots.clear();
+    }
+
+private:
+    struct Slot{
+        alignas(Type) unsigned char storage[sizeof(Type)];
+        bool live = false;
+    };
+
+    std::vector<Slot*> chunks;
+    std::vector<Slot*> freeSlots;
+    size_t used = 0;
 };
 
 struct Affiliations{
-    std::unordered_map<AffiliationID, Affiliation*> allAffiliations;
+    // Indexed by the interned ID, nullptr if there is no such affiliation
+    std::vector<Affiliation*> allAffiliations;
+    Slab<Affiliation> storage;
     unsigned int size = 0;
-    std::map<Coord, AffiliationID> coordIDPair;
+    std::map<Coord, StringHandle> coordIDPair;
+    SpatialGrid grid;
     void clearAffiliations(){
         allAffiliations.clear();
     }
@@ -143,6 +362,11 @@ public:
     // Short rationale for estimate: N insertions to a vector
     std::vector<AffiliationID> get_all_affiliations();
 
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: N calls to the visitor. The IDs are the interned ones
+    // and stay valid until clear_all
+    void for_each_affiliation(std::function<void(const AffiliationID&)> const& visitor);
+
     // Estimate of performance: O(n)
     // Short rationale for estimate: N insertions to a map
     bool add_affiliation(AffiliationID id, Name const& name, Coord xy);
@@ -159,13 +383,21 @@ public:
     // We recommend you implement the operations below only after implementing the ones above
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: N insertions to a vector
+    // Short rationale for estimate: In-order walk of the kept order
     std::vector<AffiliationID> get_affiliations_alphabetically();
 
+    // Estimate of performance: O(log(n) + limit)
+    // Short rationale for estimate: Subtree sizes lead to the offset
+    std::vector<AffiliationID> get_affiliations_alphabetically(unsigned int offset, unsigned int limit);
+
     // Estimate of performance: O(n)
-    // Short rationale for estimate: N insertions to a vector
+    // Short rationale for estimate: In-order walk of the kept order
     std::vector<AffiliationID> get_affiliations_distance_increasing();
 
+    // Estimate of performance: O(log(n) + limit)
+    // Short rationale for estimate: Subtree sizes lead to the offset
+    std::vector<AffiliationID> get_affiliations_distance_increasing(unsigned int offset, unsigned int limit);
+
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: Average map lookup time
     AffiliationID find_affiliation_with_coord(Coord xy);
@@ -197,6 +429,10 @@ public:
     // Short rationale for estimate: Average map lookup time, n times
     std::vector<AffiliationID> get_affiliations(PublicationID id);
 
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Map lookup, then n calls to the visitor with IDs valid until clear_all
+    bool for_each_affiliation_of(PublicationID id, std::function<void(const AffiliationID&)> const& visitor);
+
     // Estimate of performance: O(n)
     // Short rationale for estimate: Vector insertion time
     bool add_reference(PublicationID id, PublicationID parentid);
@@ -206,7 +442,11 @@ public:
     std::vector<PublicationID> get_direct_references(PublicationID id);
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: Average time of vector insert
+    // Short rationale for estimate: Map lookup, then n calls to the visitor
+    bool for_each_direct_reference(PublicationID id, std::function<void(PublicationID)> const& visitor);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Sorted vector insert
     bool add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid);
 
     // Estimate of performance: O(n)
@@ -217,49 +457,62 @@ public:
     // Short rationale for estimate: Average map lookup time
     PublicationID get_parent(PublicationID id);
 
-    // Estimate of performance: O(nlog(n))
-    // Short rationale for estimate: Average time for sorting a vector
+    // Estimate of performance: O(log(n) + m)
+    // Short rationale for estimate: Binary search, then m results copied
     std::vector<std::pair<Year, PublicationID>> get_publications_after(AffiliationID affiliationid, Year year);
 
-    // Estimate of performance: O(nlog(n))
-    // Short rationale for estimate: map lookup n times
+    // Estimate of performance: O(log(n) + m)
+    // Short rationale for estimate: Binary search, then m calls to the visitor
+    bool for_each_publication_after(AffiliationID affiliationid, Year year, std::function<void(Year, PublicationID)> const& visitor);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: One map lookup, then n steps up the parent array
     std::vector<PublicationID> get_referenced_by_chain(PublicationID id);
 
 
     // Non-compulsory operations
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Preorder walk along the forest links, k references
     std::vector<PublicationID> get_all_references(PublicationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Grid cells around the coordinate are read
     std::vector<AffiliationID> get_affiliations_closest_to(Coord xy);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(m*k + log(n))
+    // Short rationale for estimate: Removed from its m publications of k affiliations and the indexes
     bool remove_affiliation(AffiliationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(log(d)), O(n) after changes to inner publications
+    // Short rationale for estimate: Jump pointers skip up the chains
     PublicationID get_closest_common_parent(PublicationID id1, PublicationID id2);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(r + k*log(m))
+    // Short rationale for estimate: Only its r references, referencer and k affiliations are touched
     bool remove_publication(PublicationID publicationid);
 
 
 private:
+    // Interned affiliation IDs and names, titles are nearly all unique so they aren't interned
+    InternTable affiliationIDs;
+    InternTable names;
     Affiliations affiliationStruct;
     std::unordered_map<PublicationID, Publication> allPublications;
     bool findPublication(PublicationID);
-    std::map<Name, AffiliationID> nameMap;
-    // IDs alphabetically
-    std::vector<AffiliationID> IDvector;
-    std::vector<AffiliationID> sortedAffiliations;
+    // Affiliations kept sorted alphabetically and by distance
+    OrderedIndex alphabeticalIndex;
+    OrderedIndex distanceIndex;
     bool affiliationExists(AffiliationID);
-    std::unordered_map<PublicationID, Year> publicationYearMap;
-    std::vector<PublicationID> referencesRecursively(std::vector<PublicationID> &publications, PublicationID id);
+    Affiliation* findAffiliation(AffiliationID);
+    std::vector<AffiliationID> toIDs(std::vector<StringHandle> const& handles);
+    void insertPublication(Affiliation* affiliation, Year year, PublicationID id);
+    // Ancestor index for get_closest_common_parent, rebuilt lazily when stale
+    ReferenceForest referenceForest;
+    bool lineageStale = false;
+    void linkLineage(unsigned int slot);
+    void rebuildLineage();
+    unsigned int commonAncestor(unsigned int slot1, unsigned int slot2);
 
 };
 #endif // DATASTRUCTURES_HH
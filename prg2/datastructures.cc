@@ -8,6 +8,19 @@
 #include <cmath>
 #include <set>
 #include <algorithm>
+#include <thread>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <filesystem>
+#include <queue>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
@@ -22,29 +35,310 @@ Type random_in_range(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+// Snapshot file layout, all integers in the byte order of the machine that wrote it:
+//   header    magic, version, byte order mark, number of the last logged change
+//   ids       every interned affiliation ID in handle order, so handles stay the same
+//   affs      live affiliations: handle, name, x, y
+//   pubs      publications by year and ID: ID, title, year, affiliation handles
+//   refs      (reference, referencer) pairs in the order of the referencers' lists
+//   edges     connections in edge ID order: aff1, aff2, weight
+//   orders    affiliation handles by name, then by distance from the origin
+// Publications come in the order the lists of an affiliation keep, and the orders
+// are stored as they are, so nothing is sorted when loading. Strings are stored as a 32-bit length followed by the bytes. Everything is
+// referred to by handle or ID, never by position in memory.
+char const SNAPSHOT_MAGIC[8] = {'T', 'R', 'A', 'S', 'N', 'A', 'P', '\0'};
+unsigned int const SNAPSHOT_VERSION = 3;
+unsigned int const SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// Appends values to a snapshot image or a log record
+struct SnapshotWriter
+{
+    std::string& data;
+
+    template <typename Type>
+    void put(Type value)
+    {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(Type));
+    }
+
+    void put_string(std::string const& str)
+    {
+        put<unsigned int>(str.size());
+        data.append(str);
+    }
+
+    // Fields of the logged operations
+    template <typename Type>
+    void put_field(Type const& value)
+    {
+        put(value);
+    }
+
+    void put_field(std::string const& str)
+    {
+        put_string(str);
+    }
+
+    void put_field(Coord xy)
+    {
+        put(xy.x);
+        put(xy.y);
+    }
+
+    template <typename Type>
+    void put_field(std::vector<Type> const& values)
+    {
+        put<unsigned int>(values.size());
+        for (const Type& value : values) {
+            put_field(value);
+        }
+    }
+};
+
+// Reads values from a snapshot image or a log record. Reading past the end sets ok to false and
+// returns zeros, so a truncated file is noticed once at the end of a section.
+struct SnapshotReader
+{
+    const char* pos;
+    const char* end;
+    bool ok = true;
+
+    template <typename Type>
+    Type get()
+    {
+        Type value{};
+        if (static_cast<size_t>(end - pos) < sizeof(Type)) {
+            ok = false;
+            pos = end;
+            return value;
+        }
+        std::memcpy(&value, pos, sizeof(Type));
+        pos += sizeof(Type);
+        return value;
+    }
+
+    std::string get_string()
+    {
+        unsigned int size = get<unsigned int>();
+        if (static_cast<size_t>(end - pos) < size) {
+            ok = false;
+            pos = end;
+            return {};
+        }
+        std::string str(pos, size);
+        pos += size;
+        return str;
+    }
+
+    template <typename Type>
+    void get_field(Type& value)
+    {
+        value = get<Type>();
+    }
+
+    void get_field(std::string& str)
+    {
+        str = get_string();
+    }
+
+    void get_field(Coord& xy)
+    {
+        xy.x = get<int>();
+        xy.y = get<int>();
+    }
+
+    template <typename Type>
+    void get_field(std::vector<Type>& values)
+    {
+        unsigned int size = get<unsigned int>();
+        values.clear();
+        for (unsigned int i = 0; i < size && ok; ++i) {
+            values.emplace_back();
+            get_field(values.back());
+        }
+    }
+
+    // Everything was read and nothing was left over
+    bool complete() const
+    {
+        return ok && pos == end;
+    }
+};
+
+// FNV-1a hash of a log record, to tell a torn or corrupted record from a whole one
+unsigned int record_checksum(const char* data, size_t size)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Replaces the file at path so that a crash leaves either the old or the new contents:
+// the data is written to path.tmp and synced, renamed over path, and the directory synced
+bool replace_file(std::string const& path, std::string const& data)
+{
+    std::string temporary = path + ".tmp";
+#ifdef __unix__
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t count = ::write(fd, data.data() + written, data.size() - written);
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+        written += std::max<ssize_t>(count, 0);
+    }
+    bool synced = written == data.size() && ::fsync(fd) == 0;
+
+    if (::close(fd) != 0 || !synced || ::rename(temporary.c_str(), path.c_str()) != 0) {
+        ::unlink(temporary.c_str());
+        return false;
+    }
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    int dir = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir < 0) {
+        return false;
+    }
+    bool renamed = ::fsync(dir) == 0;
+    ::close(dir);
+    return renamed;
+#else
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), data.size());
+        if (!file.flush()) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+#endif
+}
+
 // Modify the code below to implement the functionality of the class.
 // Also remove comments from the parameter names when you implement
 // an operation (Commenting out parameter name prevents compiler from
 // warning about unused parameters on operations you haven't yet implemented.)
 
 Datastructures::Datastructures()
+    : affiliations_by_name([this](NodeID a, NodeID b) {
+          const std::string& name1 = names.str(affiliations[a]->name);
+          const std::string& name2 = names.str(affiliations[b]->name);
+
+          // Equal names are ordered by handle so that every affiliation has its own place
+          if (name1 != name2) {
+              return name1 < name2;
+          }
+          return a < b;
+      }),
+      affiliations_by_distance([this](NodeID a, NodeID b) {
+          // Squared distances are exact, ties go to the smaller y, then x
+          Coord pos1 = affiliations[a]->pos;
+          Coord pos2 = affiliations[b]->pos;
+          SquaredDistance dist1 = squared_distance(pos1, {0, 0});
+          SquaredDistance dist2 = squared_distance(pos2, {0, 0});
+          return std::tie(dist1, pos1.y, pos1.x, a) < std::tie(dist2, pos2.y, pos2.x, b);
+      })
 {
-    // Write any initialization you need here
+    graph.clear();
 }
 
 Datastructures::~Datastructures()
 {
+    close_log();
     clear_all();
 }
 
 // General affiliation search function from the datastructure.
+std::shared_lock<std::shared_mutex> Datastructures::read_lock() {
+    if (!concurrent_mode) {
+        return std::shared_lock<std::shared_mutex>(access_mutex, std::defer_lock);
+    }
+    // A change waiting for the lock holds the gate, so new queries queue behind it
+    { std::lock_guard<std::mutex> gate(writer_gate); }
+    return std::shared_lock<std::shared_mutex>(access_mutex);
+}
+
+Datastructures::WriteLock Datastructures::write_lock() {
+    if (!concurrent_mode) {
+        return WriteLock{*this, std::unique_lock<std::shared_mutex>(access_mutex, std::defer_lock)};
+    }
+    std::lock_guard<std::mutex> gate(writer_gate);
+    return WriteLock{*this, std::unique_lock<std::shared_mutex>(access_mutex)};
+}
+
+Datastructures::WriteLock::~WriteLock() {
+    if (!released && owner.log_group_full) {
+        owner.write_log_group(*this);
+    }
+}
+
+void Datastructures::use_concurrent_mode(bool enabled)
+{
+    concurrent_mode = enabled;
+}
+
+Datastructures::BufferLease::BufferLease(Datastructures& owner) : owner(owner) {
+    std::lock_guard<std::mutex> guard(owner.buffers_mutex);
+
+    if (owner.spare_buffers.empty()) {
+        buffers = std::make_unique<SearchBuffers>();
+    } else {
+        buffers = std::move(owner.spare_buffers.back());
+        owner.spare_buffers.pop_back();
+    }
+}
+
+Datastructures::BufferLease::~BufferLease() {
+    std::lock_guard<std::mutex> guard(owner.buffers_mutex);
+    owner.spare_buffers.push_back(std::move(buffers));
+}
+
+template <typename... Fields>
+bool Datastructures::log_operation(LogOp op, Fields const&... fields)
+{
+    if (log_file == nullptr) {
+        return true;
+    }
+    // Record: length, LSN, operation, fields, checksum of everything but the length
+    size_t start = log_buffer.size();
+    SnapshotWriter out{log_buffer};
+    out.put<unsigned int>(0);
+    out.put(log_lsn + 1);
+    out.put(op);
+    (out.put_field(fields), ...);
+
+    size_t length = log_buffer.size() - start - sizeof(unsigned int);
+    if (length > MAX_LOG_RECORD_BYTES) {
+        log_buffer.resize(start);
+        return false;
+    }
+    ++log_lsn;
+    unsigned int framed_length = length;
+    std::memcpy(&log_buffer[start], &framed_length, sizeof(framed_length));
+    out.put(record_checksum(&log_buffer[start + sizeof(unsigned int)], length));
+
+    // Group commit: the records are written together once there are enough of them,
+    // when the change releases its lock
+    if (log_buffer.size() >= log_group_bytes) {
+        log_group_full = true;
+    }
+    return true;
+}
+
 Affiliation* Datastructures::is_affiliation(AffiliationID id) {
-    auto search = affiliations.find(id);
+    NodeID handle = affiliation_ids.find(id);
 
-    if (search == affiliations.end()) {
+    if (handle == NO_HANDLE) {
         return nullptr;
     }
-    return search->second;
+    return affiliations[handle];
 }
 // General publication search function from the datastructure.
 Publication* Datastructures::is_publication(PublicationID id) {
@@ -58,61 +352,124 @@ Publication* Datastructures::is_publication(PublicationID id) {
 
 unsigned int Datastructures::get_affiliation_count()
 {
-    return affiliations.size();
+    auto lock = read_lock();
+    return affiliation_count;
 }
 
 void Datastructures::clear_all()
 {
-    for (auto& pub : publications) {
-        delete pub.second;
-    }
+    auto lock = write_lock();
+    clear_data();
+    log_operation(LogOp::clear_all);
+}
+
+void Datastructures::clear_data()
+{
+    publication_storage.reset();
+    affiliation_storage.reset();
 
-    for (auto& aff : affiliations) {
-        delete aff.second;
-    }
     affiliations.clear();
+    affiliation_count = 0;
+    affiliation_grid.clear();
+    affiliation_coords.clear();
+    affiliations_by_name.clear();
+    affiliations_by_distance.clear();
     publications.clear();
-    connections.clear();
+    lineage_stale = false;
+    reference_layout.clear();
+    reference_layout_stale = true;
+    affiliation_ids.clear();
+    names.clear();
+    graph.clear();
+    friction_forest_stale = true;
+    components_stale = true;
+    hierarchy.clear();
+    path_cache.clear();
+    ++graph_version;
 }
 
 std::vector<AffiliationID> Datastructures::get_all_affiliations()
 {
+    auto lock = read_lock();
     std::vector<AffiliationID> all_affiliations;
+    all_affiliations.reserve(affiliation_count);
 
-    std::transform(affiliations.begin(), affiliations.end(), std::back_inserter(all_affiliations),
-                   [](const std::pair<AffiliationID, Affiliation*>& pair) {return pair.first;}
-    );
-
+    for (const Affiliation* aff : affiliations) {
+        if (aff != nullptr) {
+            all_affiliations.push_back(affiliation_ids.str(aff->id));
+        }
+    }
     return all_affiliations;
 }
 
+void Datastructures::for_each_affiliation(std::function<void(const AffiliationID&)> const& visitor)
+{
+    auto lock = read_lock();
+    for (const Affiliation* aff : affiliations) {
+        if (aff != nullptr) {
+            visitor(affiliation_ids.str(aff->id));
+        }
+    }
+}
+
 bool Datastructures::add_affiliation(AffiliationID id, const Name &name, Coord xy)
+{
+    auto lock = write_lock();
+    Affiliation* new_affiliation = create_affiliation(id, name, xy);
+
+    if (new_affiliation == nullptr) {
+        return false;
+    }
+    affiliations_by_name.insert(new_affiliation->id);
+    affiliations_by_distance.insert(new_affiliation->id);
+    log_operation(LogOp::add_affiliation, id, name, xy);
+    return true;
+}
+
+Affiliation* Datastructures::create_affiliation(AffiliationID const& id, Name const& name, Coord xy)
 {
     // Worst case O(n)
     if (is_affiliation(id) != nullptr) {
-        return false;
+        return nullptr;
+    }
+    NodeID handle = affiliation_ids.intern(id);
+
+    // A new handle is also a new node of the connection graph
+    if (handle == affiliations.size()) {
+        affiliations.push_back(nullptr);
+        graph.add_node();
+
+        if (!components_stale) {
+            components.add();
+        }
     }
-    Affiliation* new_affiliation = new Affiliation;
-    new_affiliation->id = id;
-    new_affiliation->name = name;
+    Affiliation* new_affiliation = affiliation_storage.create();
+    new_affiliation->id = handle;
+    new_affiliation->name = names.intern(name);
     new_affiliation->pos = xy;
-    affiliations.insert({id, new_affiliation});
-    return true;
+    affiliations[handle] = new_affiliation;
+    affiliation_grid.insert(xy, handle);
+    affiliation_coords.emplace(xy, handle);
+    ++affiliation_count;
+    ++graph_version;
+    return new_affiliation;
 }
 
 Name Datastructures::get_affiliation_name(AffiliationID id)
 {
+    auto lock = read_lock();
     // Worst case O(n)
     auto search = is_affiliation(id);
 
     if (search == nullptr) {
         return NO_NAME;
     }
-    return search->name;
+    return names.str(search->name);
 }
 
 Coord Datastructures::get_affiliation_coord(AffiliationID id)
 {
+    auto lock = read_lock();
     // Worst case O(n)
     auto search = is_affiliation(id);
 
@@ -122,105 +479,123 @@ Coord Datastructures::get_affiliation_coord(AffiliationID id)
     return search->pos;
 }
 
-std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically()
+std::vector<AffiliationID> Datastructures::to_ids(std::vector<NodeID> const& handles)
 {
-    std::vector<Affiliation*> sortedAffiliations;
-    sortedAffiliations.reserve(affiliations.size());
+    std::vector<AffiliationID> ids;
+    ids.reserve(handles.size());
 
-    for (const auto& pair : affiliations) {
-        sortedAffiliations.push_back(pair.second);
+    for (NodeID handle : handles) {
+        ids.push_back(affiliation_ids.str(handle));
     }
-    std::sort(sortedAffiliations.begin(), sortedAffiliations.end(), [](Affiliation* aff1, Affiliation* aff2) {
-        return aff1->name < aff2->name;
-    });
-
-    std::vector<AffiliationID> sortedIDs;
-    sortedIDs.reserve(sortedAffiliations.size());
-
-    std::transform(sortedAffiliations.begin(), sortedAffiliations.end(), std::back_inserter(sortedIDs), [](const Affiliation* affiliation) {
-        return affiliation->id;
-    });
-    return sortedIDs;
+    return ids;
 }
 
-// Helper function to compare distances
-bool compare_distance(Affiliation* a, Affiliation* b) {
-    auto dist1 = std::sqrt((a->pos.x*a->pos.x) + (a->pos.y*a->pos.y));
-    auto dist2 = std::sqrt((b->pos.x*b->pos.x) + (b->pos.y*b->pos.y));
+std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically()
+{
+    auto lock = read_lock();
+    return to_ids(affiliations_by_name.range(0, affiliation_count));
+}
 
-    if (dist1 == dist2) {
-        return a->pos.y < b->pos.y;
-    }
-    return dist1 < dist2;
+std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically(unsigned int offset, unsigned int limit)
+{
+    auto lock = read_lock();
+    return to_ids(affiliations_by_name.range(offset, limit));
 }
 
 std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing()
 {
-    std::vector<Affiliation*> sortedAffiliations;
-
-    for (const auto& pair : affiliations) {
-        sortedAffiliations.push_back(pair.second);
-    }
-    std::sort(sortedAffiliations.begin(), sortedAffiliations.end(), compare_distance);
-
-    std::vector<AffiliationID> sortedIDs;
-    sortedIDs.reserve(affiliations.size());
+    auto lock = read_lock();
+    return to_ids(affiliations_by_distance.range(0, affiliation_count));
+}
 
-    std::transform(sortedAffiliations.begin(), sortedAffiliations.end(), std::back_inserter(sortedIDs), [](const Affiliation* affiliation) {
-        return affiliation->id;
-    });
-    return sortedIDs;
+std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing(unsigned int offset, unsigned int limit)
+{
+    auto lock = read_lock();
+    return to_ids(affiliations_by_distance.range(offset, limit));
 }
 
 AffiliationID Datastructures::find_affiliation_with_coord(Coord xy)
 {
-    auto it = std::find_if(affiliations.begin(), affiliations.end(),
-                           [&xy](const std::pair<AffiliationID, Affiliation*>& pair) {
-        return xy == pair.second->pos; });
+    auto lock = read_lock();
+    auto it = affiliation_coords.find(xy);
 
-    if (it != affiliations.end()) {
-        return it->first;
+    if (it != affiliation_coords.end()) {
+        return affiliation_ids.str(it->second);
     }
     return NO_AFFILIATION;
 }
 
+void Datastructures::erase_affiliation_coord(Coord xy, NodeID id) {
+    auto [begin, end] = affiliation_coords.equal_range(xy);
+    auto it = std::find_if(begin, end, [id](const std::pair<const Coord, NodeID>& pair) {
+        return pair.second == id;
+    });
+
+    if (it != end) {
+        affiliation_coords.erase(it);
+    }
+}
+
 bool Datastructures::change_affiliation_coord(AffiliationID id, Coord newcoord)
 {
+    auto lock = write_lock();
     // Worst case O(n)
     auto search = is_affiliation(id);
 
     if (search == nullptr) {
         return false;
     }
+    affiliation_grid.erase(search->pos, search->id);
+    affiliation_grid.insert(newcoord, search->id);
+    erase_affiliation_coord(search->pos, search->id);
+    affiliation_coords.emplace(newcoord, search->id);
+    affiliations_by_distance.erase(search->id);
     search->pos = newcoord;
+    affiliations_by_distance.insert(search->id);
+    ++graph_version;
+    log_operation(LogOp::change_affiliation_coord, id, newcoord);
     return true;
 }
 
 bool Datastructures::add_publication(PublicationID id, const Name &name, Year year, const std::vector<AffiliationID> &affiliations)
 {
-    // Worst case O(n)
-    if (is_publication(id) != nullptr) {
+    auto lock = write_lock();
+    Publication* new_publication = create_publication(id, name, year);
+
+    if (new_publication == nullptr) {
         return false;
     }
-    Publication* new_publication = new Publication;
-    new_publication->id = id;
-    new_publication->title = name;
-    new_publication->year = year;
-
     if (affiliations.size() != 0) {
-        new_publication->related_affiliations = affiliations;
+        new_publication->related_affiliations.reserve(affiliations.size());
         for (auto& affId : affiliations) {
             Affiliation* aff = is_affiliation(affId);
-            aff->publications.push_back(new_publication);
+            insert_publication(aff, new_publication);
+            new_publication->related_affiliations.push_back(aff->id);
         }
-        add_connections(affiliations);
+        add_connections(new_publication->related_affiliations);
     }
-    publications.insert({id, new_publication});
+    log_operation(LogOp::add_publication, id, name, year, affiliations);
     return true;
 }
 
+Publication* Datastructures::create_publication(PublicationID id, Name const& name, Year year)
+{
+    // Worst case O(n)
+    if (is_publication(id) != nullptr) {
+        return nullptr;
+    }
+    Publication* new_publication = publication_storage.create();
+    new_publication->id = id;
+    new_publication->title = name;
+    new_publication->year = year;
+    new_publication->jump = new_publication;
+    publications.insert({id, new_publication});
+    return new_publication;
+}
+
 std::vector<PublicationID> Datastructures::all_publications()
 {
+    auto lock = read_lock();
     std::vector<PublicationID> all_publications;
     all_publications.reserve(publications.size());
 
@@ -233,6 +608,7 @@ std::vector<PublicationID> Datastructures::all_publications()
 
 Name Datastructures::get_publication_name(PublicationID id)
 {
+    auto lock = read_lock();
     // Worst case O(n)
     auto search = is_publication(id);
 
@@ -244,6 +620,7 @@ Name Datastructures::get_publication_name(PublicationID id)
 
 Year Datastructures::get_publication_year(PublicationID id)
 {
+    auto lock = read_lock();
     // Worst case O(n)
     auto search = is_publication(id);
 
@@ -255,6 +632,7 @@ Year Datastructures::get_publication_year(PublicationID id)
 
 std::vector<AffiliationID> Datastructures::get_affiliations(PublicationID id)
 {
+    auto lock = read_lock();
     std::vector<AffiliationID> affs = {NO_AFFILIATION};
 
     // Worst case O(n)
@@ -263,10 +641,42 @@ std::vector<AffiliationID> Datastructures::get_affiliations(PublicationID id)
     if (search == nullptr) {
         return affs;
     }
-    return search->related_affiliations;
+    affs.clear();
+    affs.reserve(search->related_affiliations.size());
+
+    for (NodeID aff : search->related_affiliations) {
+        affs.push_back(affiliation_ids.str(aff));
+    }
+    return affs;
+}
+
+bool Datastructures::for_each_affiliation_of(PublicationID id, std::function<void(const AffiliationID&)> const& visitor)
+{
+    auto lock = read_lock();
+    // Worst case O(n)
+    auto search = is_publication(id);
+
+    if (search == nullptr) {
+        return false;
+    }
+    for (NodeID aff : search->related_affiliations) {
+        visitor(affiliation_ids.str(aff));
+    }
+    return true;
 }
 
 bool Datastructures::add_reference(PublicationID id, PublicationID parentid)
+{
+    auto lock = write_lock();
+
+    if (!link_reference(id, parentid)) {
+        return false;
+    }
+    log_operation(LogOp::add_reference, id, parentid);
+    return true;
+}
+
+bool Datastructures::link_reference(PublicationID id, PublicationID parentid)
 {
     // Worst case O(n)
     auto search1 = is_publication(id);
@@ -281,11 +691,21 @@ bool Datastructures::add_reference(PublicationID id, PublicationID parentid)
     }
     search2->references.push_back(search1);
     search1->referencer = search2;
+    reference_layout_stale = true;
+
+    // A leaf gets its jump pointer right away, a subtree moving under a new root
+    // changes the depths of all of it and waits for the next rebuild
+    if (search1->references.empty() && !lineage_stale) {
+        link_lineage(search1);
+    } else {
+        lineage_stale = true;
+    }
     return true;
 }
 
 std::vector<PublicationID> Datastructures::get_direct_references(PublicationID id)
 {
+    auto lock = read_lock();
     std::vector<PublicationID> references;
 
     // Worst case O(n)
@@ -294,17 +714,52 @@ std::vector<PublicationID> Datastructures::get_direct_references(PublicationID i
     if (search == nullptr) {
         return references.push_back(NO_PUBLICATION), references;
     }
-    std::vector<Publication*> direct_references = search->references;
-    references.reserve(direct_references.size());
+    references.reserve(search->references.size());
 
-    for (auto& ref : direct_references) {
+    for (const Publication* ref : search->references) {
         references.push_back(ref->id);
     }
     return references;
 }
 
+bool Datastructures::for_each_direct_reference(PublicationID id, std::function<void(PublicationID)> const& visitor)
+{
+    auto lock = read_lock();
+    // Worst case O(n)
+    auto search = is_publication(id);
+
+    if (search == nullptr) {
+        return false;
+    }
+    for (const Publication* ref : search->references) {
+        visitor(ref->id);
+    }
+    return true;
+}
+
+// Order of the publications of an affiliation
+bool publication_order(const Publication* pub1, const Publication* pub2) {
+    if (pub1->year != pub2->year) {
+        return pub1->year < pub2->year;
+    }
+    return pub1->id < pub2->id;
+}
+
+// First publication from the given year onwards in a list kept in publication_order
+std::vector<Publication*>::const_iterator first_publication_after(const std::vector<Publication*>& pubs, Year year) {
+    return std::partition_point(pubs.begin(), pubs.end(), [year](const Publication* pub) {
+        return pub->year < year;
+    });
+}
+
+void Datastructures::insert_publication(Affiliation* aff, Publication* pub) {
+    auto& pubs = aff->publications;
+    pubs.insert(std::upper_bound(pubs.begin(), pubs.end(), pub, publication_order), pub);
+}
+
 bool Datastructures::add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid)
 {
+    auto lock = write_lock();
     // Worst case O(n)
     auto search_pub = is_publication(publicationid);
     auto search_aff = is_affiliation(affiliationid);
@@ -312,16 +767,18 @@ bool Datastructures::add_affiliation_to_publication(AffiliationID affiliationid,
     if (search_aff == nullptr || search_pub == nullptr) {
         return false;
     }
-    for (auto& affiliation : search_pub->related_affiliations) {
-        add_connection(affiliationid, affiliation);
+    for (NodeID affiliation : search_pub->related_affiliations) {
+        add_connection(search_aff->id, affiliation);
     }
     search_pub->related_affiliations.push_back(search_aff->id);
-    search_aff->publications.push_back(search_pub);
+    insert_publication(search_aff, search_pub);
+    log_operation(LogOp::add_affiliation_to_publication, affiliationid, publicationid);
     return true;
 }
 
 std::vector<PublicationID> Datastructures::get_publications(AffiliationID id)
 {
+    auto lock = read_lock();
     std::vector<PublicationID> pubs;
 
     // Worst case O(n)
@@ -339,6 +796,7 @@ std::vector<PublicationID> Datastructures::get_publications(AffiliationID id)
 
 PublicationID Datastructures::get_parent(PublicationID id)
 {
+    auto lock = read_lock();
     // Worst case O(n)
     auto search = is_publication(id);
 
@@ -353,33 +811,45 @@ PublicationID Datastructures::get_parent(PublicationID id)
 
 std::vector<std::pair<Year, PublicationID> > Datastructures::get_publications_after(AffiliationID affiliationid, Year year)
 {
+    auto lock = read_lock();
     // Worst case O(n)
     auto search  = is_affiliation(affiliationid);
 
     if (search == nullptr) {
         return {{NO_YEAR, NO_PUBLICATION}};
     }
+    auto first = first_publication_after(search->publications, year);
 
     std::vector<std::pair<Year, PublicationID>> pubs;
-    const std::vector<Publication*> related_publications = search->publications;
+    pubs.reserve(search->publications.end() - first);
 
-    for (const Publication* pub : related_publications) {
-        if (pub->year >= year) {
-            pubs.emplace_back(pub->year, pub->id);
-        }
+    for (auto it = first; it != search->publications.end(); ++it) {
+        pubs.emplace_back((*it)->year, (*it)->id);
     }
-    std::sort(pubs.begin(), pubs.end(), [](std::pair<Year, PublicationID> pair1, std::pair<Year, PublicationID> pair2){
-        if (pair1.first == pair2.first) {
-            return pair1.second < pair2.second;
-        }
-        return pair1.first < pair2.first;
-    });
-
     return pubs;
 }
 
+bool Datastructures::for_each_publication_after(AffiliationID affiliationid, Year year,
+                                                std::function<void(Year, PublicationID)> const& visitor)
+{
+    auto lock = read_lock();
+    // Worst case O(n)
+    auto search  = is_affiliation(affiliationid);
+
+    if (search == nullptr) {
+        return false;
+    }
+    auto first = first_publication_after(search->publications, year);
+
+    for (auto it = first; it != search->publications.end(); ++it) {
+        visitor((*it)->year, (*it)->id);
+    }
+    return true;
+}
+
 std::vector<PublicationID> Datastructures::get_referenced_by_chain(PublicationID id)
 {
+    auto lock = read_lock();
     std::vector<PublicationID> referencers;
 
     // Worst case O(n)
@@ -396,21 +866,9 @@ std::vector<PublicationID> Datastructures::get_referenced_by_chain(PublicationID
     return referencers;
 }
 
-// Recursive helper function for get_all_references
-void insert_references(std::vector<PublicationID> &references, Publication* publication) {
-    if (publication->references.empty()) {
-        return;
-    }
-    else {
-        for (auto& reference : publication->references) {
-            references.push_back(reference->id);
-            insert_references(references, reference);
-        }
-    }
-}
-
 std::vector<PublicationID> Datastructures::get_all_references(PublicationID id)
 {
+    auto lock = read_lock();
     std::vector<PublicationID> references;
 
     // Worst case O(n)
@@ -419,105 +877,216 @@ std::vector<PublicationID> Datastructures::get_all_references(PublicationID id)
     if (search == nullptr) {
         return references.push_back(NO_PUBLICATION), references;
     }
-    insert_references(references, search);
+    if (search->references.empty()) {
+        return references;
+    }
+
+    if (reference_layout_enabled) {
+        {
+            std::lock_guard<std::mutex> rebuild(rebuild_mutex);
+            if (reference_layout_stale) {
+                build_reference_layout();
+            }
+        }
+        auto begin = reference_layout.begin() + search->layout_index;
+        return std::vector<PublicationID>(begin + 1, begin + search->layout_size);
+    }
+
+    // Preorder with an explicit stack, references pushed in reverse so they come out in order
+    std::vector<Publication*> stack(search->references.rbegin(), search->references.rend());
 
+    while (!stack.empty()) {
+        Publication* pub = stack.back();
+        stack.pop_back();
+        references.push_back(pub->id);
+        stack.insert(stack.end(), pub->references.rbegin(), pub->references.rend());
+    }
     return references;
 }
 
-// Helper function to calculate the distance between points
-double distance(const Coord& a, const Coord& b) {
-    int dx = a.x - b.x;
-    int dy = a.y - b.y;
-    return std::sqrt(dx * dx + dy * dy);
+void Datastructures::use_reference_layout(bool enabled)
+{
+    auto lock = write_lock();
+    reference_layout_enabled = enabled;
 }
 
-std::vector<AffiliationID> Datastructures::get_affiliations_closest_to(Coord xy)
-{
-    std::vector<std::pair<AffiliationID, double>> closest_affiliations;
+void Datastructures::build_reference_layout() {
+    reference_layout.clear();
+    reference_layout.reserve(publications.size());
 
-    for (auto &aff : affiliations) {
-        double dist = distance(aff.second->pos, xy);
-        closest_affiliations.emplace_back(aff.first, dist);
-    }
+    std::vector<Publication*> order;
+    order.reserve(publications.size());
+    std::vector<Publication*> stack;
 
-    if (closest_affiliations.empty()) {
-        return {};
+    for (const auto& [id, root] : publications) {
+        if (root->referencer != nullptr) {
+            continue;
+        }
+        stack.push_back(root);
+
+        while (!stack.empty()) {
+            Publication* pub = stack.back();
+            stack.pop_back();
+            pub->layout_index = reference_layout.size();
+            pub->layout_size = 1;
+            reference_layout.push_back(pub->id);
+            order.push_back(pub);
+            stack.insert(stack.end(), pub->references.rbegin(), pub->references.rend());
+        }
     }
-
-    std::sort(closest_affiliations.begin(), closest_affiliations.end(),[this](std::pair<AffiliationID, double>& a, std::pair<AffiliationID, double>& b) {
-        if (a.second == b.second) {
-            return affiliations[a.first]->pos.y < affiliations[b.first]->pos.y;
+    // References come after their referencer, so going backwards every subtree
+    // is complete before it is added to its referencer
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        if ((*it)->referencer != nullptr) {
+            (*it)->referencer->layout_size += (*it)->layout_size;
         }
-        return a.second < b.second;
-    });
+    }
+    reference_layout_stale = false;
+}
 
-    std::vector<AffiliationID> result;
+// Helper function to calculate the distance between points
+double distance(const Coord& a, const Coord& b) {
+    double dx = static_cast<double>(a.x) - b.x;
+    double dy = static_cast<double>(a.y) - b.y;
+    return std::sqrt(dx * dx + dy * dy);
+}
 
-    int count = closest_affiliations.size();
+std::vector<AffiliationID> Datastructures::get_affiliations_closest_to(Coord xy)
+{
+    auto lock = read_lock();
+    std::vector<AffiliationID> result;
 
-    if (count >= 3) {
-        count = 3;
-    }
-    for (int i = 0; i < count; ++i) {
-        result.push_back(closest_affiliations[i].first);
+    for (NodeID id : affiliation_grid.nearest(xy, 3)) {
+        result.push_back(affiliation_ids.str(id));
     }
     return result;
 }
 
 bool Datastructures::remove_affiliation(AffiliationID id)
 {
+    auto lock = write_lock();
     // Worst case O(n)
     auto search = is_affiliation(id);
 
     if (search == nullptr) {
         return false;
     }
-    std::vector<Publication*> related_publications = search->publications;
-
-    for (auto& pub : related_publications) {
+    for (Publication* pub : search->publications) {
         auto& affs = pub->related_affiliations;
-        affs.erase(std::remove(affs.begin(), affs.end(), id), affs.end());
+        affs.erase(std::remove(affs.begin(), affs.end(), search->id), affs.end());
+    }
+    // The handle is reused if the ID is added again, so no connection may be left behind
+    if (graph.remove_connections(search->id)) {
+        components_stale = true;
     }
-    affiliations.erase(search->id);
-    delete search;
+    friction_forest_stale = true;
+    ++graph_version;
+
+    affiliation_grid.erase(search->pos, search->id);
+    erase_affiliation_coord(search->pos, search->id);
+    affiliations_by_name.erase(search->id);
+    affiliations_by_distance.erase(search->id);
+    affiliations[search->id] = nullptr;
+    --affiliation_count;
+    affiliation_storage.destroy(search);
+    log_operation(LogOp::remove_affiliation, id);
     return true;
 }
 
-PublicationID Datastructures::get_closest_common_parent(PublicationID id1, PublicationID id2)
-{
-    // Worst case O(n)
-    auto pub1 = is_publication(id1);
-    auto pub2 = is_publication(id2);
-
-    std::set<PublicationID> pub1parents;
-    std::vector<PublicationID> pub2parents;
+void Datastructures::link_lineage(Publication* pub) {
+    Publication* parent = pub->referencer;
 
-    if (pub1 == nullptr || pub2 == nullptr) {
-        return NO_PUBLICATION;
-    }
-
-    while (pub1->referencer != nullptr) {
-        pub1 = pub1->referencer;
-        pub1parents.insert(pub1->id);
+    if (parent == nullptr) {
+        pub->depth = 0;
+        pub->jump = pub;
+        return;
     }
-
-    while (pub2->referencer != nullptr) {
-        pub2 = pub2->referencer;
-        pub2parents.push_back(pub2->id);
+    pub->depth = parent->depth + 1;
+
+    // Skew-binary jump pointers: when the parent's jump is as long as the jump after
+    // it, the two are combined into one. Any ancestor is then O(log(d)) jumps away
+    // with one pointer per publication.
+    Publication* jump = parent->jump;
+    if (parent->depth - jump->depth == jump->depth - jump->jump->depth) {
+        pub->jump = jump->jump;
+    } else {
+        pub->jump = parent;
     }
+}
 
-    for (size_t i = 0; i < pub2parents.size(); i++) {
-        PublicationID current =  pub2parents.at(i);
+void Datastructures::rebuild_lineage() {
+    std::vector<Publication*> stack;
 
-        if (pub1parents.find(current) != pub1parents.end())  {
-            return current;
+    for (const auto& [id, pub] : publications) {
+        if (pub->referencer == nullptr) {
+            stack.push_back(pub);
         }
     }
-    return NO_PUBLICATION;
+    // Every publication is linked after its referencer
+    while (!stack.empty()) {
+        Publication* pub = stack.back();
+        stack.pop_back();
+        link_lineage(pub);
+        stack.insert(stack.end(), pub->references.begin(), pub->references.end());
+    }
+    lineage_stale = false;
+}
+
+Publication* Datastructures::common_ancestor(Publication* pub1, Publication* pub2) {
+    {
+        std::lock_guard<std::mutex> rebuild(rebuild_mutex);
+        if (lineage_stale) {
+            rebuild_lineage();
+        }
+    }
+    if (pub1->depth < pub2->depth) {
+        std::swap(pub1, pub2);
+    }
+    // Lift the deeper one to the same depth
+    while (pub1->depth > pub2->depth) {
+        pub1 = pub1->jump->depth >= pub2->depth ? pub1->jump : pub1->referencer;
+    }
+    // Jumps from equal depths land on equal depths, so the two stay level
+    while (pub1 != pub2) {
+        if (pub1->referencer == nullptr) {
+            return nullptr;
+        }
+        if (pub1->jump != pub2->jump) {
+            pub1 = pub1->jump;
+            pub2 = pub2->jump;
+        } else {
+            pub1 = pub1->referencer;
+            pub2 = pub2->referencer;
+        }
+    }
+    return pub1;
+}
+
+PublicationID Datastructures::get_closest_common_parent(PublicationID id1, PublicationID id2)
+{
+    auto lock = read_lock();
+    // Worst case O(n)
+    auto pub1 = is_publication(id1);
+    auto pub2 = is_publication(id2);
+
+    if (pub1 == nullptr || pub2 == nullptr) {
+        return NO_PUBLICATION;
+    }
+    if (pub1->referencer == nullptr || pub2->referencer == nullptr) {
+        return NO_PUBLICATION;
+    }
+    // The publications themselves don't count, so the search starts from their referencers
+    Publication* common = common_ancestor(pub1->referencer, pub2->referencer);
+
+    if (common == nullptr) {
+        return NO_PUBLICATION;
+    }
+    return common->id;
 }
 
 bool Datastructures::remove_publication(PublicationID publicationid)
 {
+    auto lock = write_lock();
     // Worst case O(n)
     auto search = is_publication(publicationid);
 
@@ -529,172 +1098,2674 @@ bool Datastructures::remove_publication(PublicationID publicationid)
     for (auto& reference : pub_references) {
         reference->referencer = nullptr;
     }
+    // The references become roots of their own trees. Removing a leaf leaves the
+    // jump pointers of the others valid.
+    if (!pub_references.empty()) {
+        lineage_stale = true;
+    }
+    reference_layout_stale = true;
     auto& referencer = search->referencer;
 
     if (referencer != nullptr) {
         auto& parent_refs = referencer->references;
-        parent_refs.erase(std::remove_if(parent_refs.begin(), parent_refs.end(), [publicationid](Publication* pub)
-                          {return pub->id == publicationid; }));
+        parent_refs.erase(std::find(parent_refs.begin(), parent_refs.end(), search));
     }
-    auto& affiliations = search->related_affiliations;
-
-    for (auto& id : affiliations) {
-        Affiliation* aff = is_affiliation(id);
-        aff->publications.erase(std::remove_if(aff->publications.begin(), aff->publications.end(), [publicationid](Publication* pub)
-                                {return pub->id == publicationid; }));
+    for (NodeID id : search->related_affiliations) {
+        Affiliation* aff = affiliations[id];
+        auto [begin, end] = std::equal_range(aff->publications.begin(), aff->publications.end(), search, publication_order);
+        aff->publications.erase(begin, end);
     }
+    remove_connections(search->related_affiliations);
 
     publications.erase(publicationid);
-    delete search;
+    publication_storage.destroy(search);
+    log_operation(LogOp::remove_publication, publicationid);
     return true;
 }
 
-bool Datastructures::compare_connection_affs_inverted(const Connection& c1, const Connection& c2) {
-    return (c1.aff1 == c2.aff2 && c1.aff2 == c2.aff1);
+long long SpatialGrid::cell_of(int value) const {
+    // Rounds towards negative infinity also for negative coordinates
+    long long cell = value / cell_size;
+    if (value < 0 && cell * cell_size != value) {
+        --cell;
+    }
+    return cell;
 }
 
-bool Datastructures::compare_connection_affs(const Connection& c1, const Connection& c2) {
-    return (c1.aff1 == c2.aff1 && c1.aff2 == c2.aff2);
+unsigned long long SpatialGrid::key(long long cell_x, long long cell_y) {
+    return (static_cast<unsigned long long>(static_cast<unsigned int>(cell_x)) << 32)
+            | static_cast<unsigned int>(cell_y);
 }
 
-bool Datastructures::has_connection(AffiliationID aff1, AffiliationID aff2) {
-    auto search1 = connections.find(aff1);
-    if (search1 != connections.end()) {
-        const auto& connections1 = search1->second;
-
-        auto it = std::find_if(connections1.begin(), connections1.end(),
-            [aff1, aff2, this](const Connection& connection) {
-                return compare_connection_affs(connection, {aff1, aff2, 0}) ||
-                       compare_connection_affs(connection, {aff2, aff1, 0});
-            });
-        return it != connections1.end();
+void SpatialGrid::add_to_cell(Coord xy, NodeID id) {
+    long long cell_x = cell_of(xy.x);
+    long long cell_y = cell_of(xy.y);
+    cells[key(cell_x, cell_y)].emplace_back(xy, id);
+
+    if (min_x > max_x) {
+        min_x = max_x = cell_x;
+        min_y = max_y = cell_y;
+    } else {
+        min_x = std::min(min_x, cell_x);
+        max_x = std::max(max_x, cell_x);
+        min_y = std::min(min_y, cell_y);
+        max_y = std::max(max_y, cell_y);
     }
-    return false;
 }
 
-void Datastructures::add_connection(AffiliationID aff1, AffiliationID aff2) {
-    if (aff1 == aff2) {
+void SpatialGrid::insert(Coord xy, NodeID id) {
+    add_to_cell(xy, id);
+    ++count;
+
+    if (count > 2 * std::max(built_for, MIN_REBUILD)) {
+        rebuild();
+    }
+}
+
+void SpatialGrid::erase(Coord xy, NodeID id) {
+    auto cell = cells.find(key(cell_of(xy.x), cell_of(xy.y)));
+
+    if (cell == cells.end()) {
         return;
     }
-    auto [it1, inserted1] = connections.emplace(aff1, std::vector<Connection>{});
-    auto [it2, inserted2] = connections.emplace(aff2, std::vector<Connection>{});
+    auto& points = cell->second;
+    auto it = std::find_if(points.begin(), points.end(), [id](const std::pair<Coord, NodeID>& point) {
+        return point.second == id;
+    });
 
-    Connection new_connection1{aff1, aff2, 1};
-    Connection new_connection2{aff2, aff1, 1};
+    if (it == points.end()) {
+        return;
+    }
+    *it = points.back();
+    points.pop_back();
 
-    auto connection1It = std::find_if(it1->second.begin(), it1->second.end(),
-        [&new_connection1, this](const Connection& existing_connection) {
-            return compare_connection_affs(existing_connection, new_connection1);
-        });
+    if (points.empty()) {
+        cells.erase(cell);
+    }
+    --count;
 
-    auto connection2It = std::find_if(it2->second.begin(), it2->second.end(),
-        [&new_connection2, this](const Connection& existing_connection) {
-            return compare_connection_affs(existing_connection, new_connection2);
-        });
+    if (count * 2 < built_for) {
+        rebuild();
+    }
+}
+
+void SpatialGrid::clear() {
+    cells.clear();
+    cell_size = 1;
+    count = 0;
+    built_for = 0;
+    min_x = min_y = 0;
+    max_x = max_y = -1;
+}
+
+void SpatialGrid::rebuild() {
+    std::vector<std::pair<Coord, NodeID>> points;
+    points.reserve(count);
+
+    long long low_x = std::numeric_limits<long long>::max();
+    long long low_y = low_x;
+    long long high_x = std::numeric_limits<long long>::min();
+    long long high_y = high_x;
+
+    for (const auto& cell : cells) {
+        for (const auto& point : cell.second) {
+            points.push_back(point);
+            low_x = std::min<long long>(low_x, point.first.x);
+            high_x = std::max<long long>(high_x, point.first.x);
+            low_y = std::min<long long>(low_y, point.first.y);
+            high_y = std::max<long long>(high_y, point.first.y);
+        }
+    }
+    cells.clear();
+    min_x = min_y = 0;
+    max_x = max_y = -1;
+    built_for = points.size();
+
+    if (points.empty()) {
+        cell_size = 1;
+        return;
+    }
+    // Side of a square holding TARGET_PER_CELL affiliations if they were spread evenly
+    double area = static_cast<double>(high_x - low_x + 1) * (high_y - low_y + 1);
+    cell_size = std::max(1LL, static_cast<long long>(std::sqrt(area * TARGET_PER_CELL / points.size())));
+
+    for (const auto& point : points) {
+        add_to_cell(point.first, point.second);
+    }
+}
+
+std::vector<NodeID> SpatialGrid::nearest(Coord xy, size_t k) const {
+    // Closest candidates so far as (squared distance, y, id), kept sorted
+    std::vector<std::tuple<SquaredDistance, int, NodeID>> best;
+
+    auto consider = [&best, &xy, k](const std::vector<std::pair<Coord, NodeID>>& points) {
+        for (const auto& [pos, id] : points) {
+            std::tuple<SquaredDistance, int, NodeID> candidate{squared_distance(pos, xy), pos.y, id};
+
+            if (best.size() == k && !(candidate < best.back())) {
+                continue;
+            }
+            best.insert(std::upper_bound(best.begin(), best.end(), candidate), candidate);
+            if (best.size() > k) {
+                best.pop_back();
+            }
+        }
+    };
+
+    if (count == 0 || k == 0) {
+        return {};
+    }
+    long long center_x = cell_of(xy.x);
+    long long center_y = cell_of(xy.y);
+
+    // Rings of cells around the query cell, starting from the first ring that reaches the bounding box
+    long long first = std::max({0LL, min_x - center_x, center_x - max_x, min_y - center_y, center_y - max_y});
+    long long last = std::max({center_x - min_x, max_x - center_x, center_y - min_y, max_y - center_y});
+    size_t visited = 0;
+
+    for (long long ring = first; ring <= last; ++ring) {
+        // Every point in this ring is at least (ring - 1) cells away. A smaller bound is
+        // still a bound, so the gap is capped to keep its square in 64 bits.
+        unsigned long long gap = std::min((ring - 1) * cell_size, 0xffffffffLL);
+        if (ring > 0 && best.size() == k && std::get<0>(best.back()) < SquaredDistance{false, gap * gap}) {
+            break;
+        }
+        // Ring has more cells than are occupied, reading all cells is cheaper
+        if (visited > cells.size()) {
+            best.clear();
+            for (const auto& cell : cells) {
+                consider(cell.second);
+            }
+            break;
+        }
+        long long low_x = std::max(center_x - ring, min_x);
+        long long high_x = std::min(center_x + ring, max_x);
+        long long low_y = std::max(center_y - ring, min_y);
+        long long high_y = std::min(center_y + ring, max_y);
+
+        auto visit = [&](long long cell_x, long long cell_y) {
+            ++visited;
+            auto cell = cells.find(key(cell_x, cell_y));
+            if (cell != cells.end()) {
+                consider(cell->second);
+            }
+        };
+        for (long long cell_y : {center_y - ring, center_y + ring}) {
+            if (cell_y >= min_y && cell_y <= max_y) {
+                for (long long cell_x = low_x; cell_x <= high_x; ++cell_x) {
+                    visit(cell_x, cell_y);
+                }
+            }
+            if (ring == 0) {
+                break;
+            }
+        }
+        for (long long cell_x : {center_x - ring, center_x + ring}) {
+            if (ring == 0 || cell_x < min_x || cell_x > max_x) {
+                continue;
+            }
+            for (long long cell_y = std::max(low_y, center_y - ring + 1); cell_y <= std::min(high_y, center_y + ring - 1); ++cell_y) {
+                visit(cell_x, cell_y);
+            }
+        }
+    }
 
-    if (connection1It != it1->second.end()) {
-        connection1It->weight += 1;
+    std::vector<NodeID> ids;
+    ids.reserve(best.size());
+    for (const auto& candidate : best) {
+        ids.push_back(std::get<2>(candidate));
+    }
+    return ids;
+}
+
+unsigned int OrderedIndex::priority(NodeID id) {
+    // Heap priorities come from a hash of the handle, which is as good as random for
+    // the shape of the tree and needs no storage
+    unsigned int h = id * 0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+unsigned int OrderedIndex::size_of(NodeID node) const {
+    return node == NO_NODE ? 0 : sizes[node];
+}
+
+void OrderedIndex::update(NodeID node) {
+    sizes[node] = 1 + size_of(left[node]) + size_of(right[node]);
+}
+
+NodeID OrderedIndex::merge(NodeID lower, NodeID upper) {
+    if (lower == NO_NODE) {
+        return upper;
+    }
+    if (upper == NO_NODE) {
+        return lower;
+    }
+    if (priority(lower) > priority(upper)) {
+        right[lower] = merge(right[lower], upper);
+        update(lower);
+        return lower;
+    }
+    left[upper] = merge(lower, left[upper]);
+    update(upper);
+    return upper;
+}
+
+void OrderedIndex::split(NodeID tree, NodeID id, NodeID& lower, NodeID& upper) {
+    // Nodes ordered before id go to lower, the rest to upper
+    if (tree == NO_NODE) {
+        lower = NO_NODE;
+        upper = NO_NODE;
+        return;
+    }
+    if (less(tree, id)) {
+        split(right[tree], id, right[tree], upper);
+        lower = tree;
     } else {
-        it1->second.push_back(new_connection1);
+        split(left[tree], id, lower, left[tree]);
+        upper = tree;
     }
+    update(tree);
+}
 
-    if (connection2It != it2->second.end()) {
-        connection2It->weight += 1;
+NodeID OrderedIndex::erase_from(NodeID tree, NodeID id) {
+    if (tree == NO_NODE) {
+        return NO_NODE;
+    }
+    if (tree == id) {
+        return merge(left[id], right[id]);
+    }
+    if (less(id, tree)) {
+        left[tree] = erase_from(left[tree], id);
     } else {
-        it2->second.push_back(new_connection2);
+        right[tree] = erase_from(right[tree], id);
     }
+    update(tree);
+    return tree;
 }
 
-void Datastructures::add_connections(const std::vector<AffiliationID>& affiliations) {
-    for (auto it1 = affiliations.begin(); it1 != affiliations.end(); ++it1) {
-        for (auto it2 = std::next(it1); it2 != affiliations.end(); ++it2) {
-            add_connection(*it1, *it2);
+void OrderedIndex::insert(NodeID id) {
+    if (id >= sizes.size()) {
+        left.resize(id + 1, NO_NODE);
+        right.resize(id + 1, NO_NODE);
+        sizes.resize(id + 1, 0);
+    }
+    left[id] = NO_NODE;
+    right[id] = NO_NODE;
+    sizes[id] = 1;
+
+    NodeID lower, upper;
+    split(root, id, lower, upper);
+    root = merge(merge(lower, id), upper);
+}
+
+void OrderedIndex::erase(NodeID id) {
+    root = erase_from(root, id);
+}
+
+void OrderedIndex::clear() {
+    root = NO_NODE;
+    left.clear();
+    right.clear();
+    sizes.clear();
+}
+
+void OrderedIndex::build(std::vector<NodeID> ids) {
+    std::sort(ids.begin(), ids.end(), less);
+    build_sorted(ids);
+}
+
+void OrderedIndex::build_sorted(std::vector<NodeID> const& ids) {
+    clear();
+
+    for (NodeID id : ids) {
+        if (id >= sizes.size()) {
+            left.resize(id + 1, NO_NODE);
+            right.resize(id + 1, NO_NODE);
+            sizes.resize(id + 1, 0);
+        }
+    }
+    // Cartesian tree of the sorted handles by priority. The stack holds the right
+    // spine of the tree so far; a node is complete when it leaves the spine.
+    std::vector<NodeID> spine;
+
+    for (NodeID id : ids) {
+        NodeID last = NO_NODE;
+
+        while (!spine.empty() && priority(spine.back()) < priority(id)) {
+            last = spine.back();
+            spine.pop_back();
+            update(last);
+        }
+        left[id] = last;
+        right[id] = NO_NODE;
+        if (!spine.empty()) {
+            right[spine.back()] = id;
         }
+        spine.push_back(id);
+    }
+    root = spine.empty() ? NO_NODE : spine.front();
+
+    while (!spine.empty()) {
+        update(spine.back());
+        spine.pop_back();
     }
 }
 
-std::vector<Connection> Datastructures::get_connected_affiliations(AffiliationID id)
-{
-    std::vector<Connection> connected_affiliations;
-    auto it = connections.find(id);
-    if (it != connections.end()) {
-        connected_affiliations = it->second;
+size_t OrderedIndex::size() const {
+    return size_of(root);
+}
+
+std::vector<NodeID> OrderedIndex::range(size_t offset, size_t limit) const {
+    std::vector<NodeID> result;
+
+    if (offset >= size()) {
+        return result;
     }
-    return connected_affiliations;
+    result.reserve(std::min(limit, size() - offset));
+
+    // Descend to the node at position offset. The stack keeps the nodes still to be
+    // visited in order, the node itself on top.
+    std::vector<NodeID> stack;
+    NodeID node = root;
+    size_t skip = offset;
+
+    while (node != NO_NODE) {
+        size_t left_size = size_of(left[node]);
+
+        if (skip < left_size) {
+            stack.push_back(node);
+            node = left[node];
+        } else if (skip == left_size) {
+            stack.push_back(node);
+            break;
+        } else {
+            skip -= left_size + 1;
+            node = right[node];
+        }
+    }
+    while (!stack.empty() && result.size() < limit) {
+        node = stack.back();
+        stack.pop_back();
+        result.push_back(node);
+
+        for (NodeID next = right[node]; next != NO_NODE; next = left[next]) {
+            stack.push_back(next);
+        }
+    }
+    return result;
 }
 
-Connection Datastructures::search_inverted_connection(Connection connection) {
-    auto aff = connections.find(connection.aff2);
+size_t EdgeIndex::slot(unsigned long long key) const {
+    // Finalizer of splitmix64 spreads the packed node pair over the table
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key & (keys.size() - 1);
+}
 
-    if (aff != connections.end()) {
-        auto it = std::find_if(aff->second.begin(), aff->second.end(),
-            [&connection, this](const Connection& connectionInAff) {
-                return compare_connection_affs_inverted(connectionInAff, connection);
-            });
-        if (it != aff->second.end()) {
-            return *it;
+EdgeID EdgeIndex::find(NodeID a, NodeID b) const {
+    if (keys.empty()) {
+        return NO_EDGE;
+    }
+    unsigned long long key = pack(a, b);
+
+    for (size_t i = slot(key); keys[i] != EMPTY; i = (i + 1) & (keys.size() - 1)) {
+        if (keys[i] == key) {
+            return values[i];
         }
     }
-    return connection;
+    return NO_EDGE;
 }
 
-std::vector<Connection> Datastructures::get_all_connections() {
-    std::vector<Connection> all_connections;
+void EdgeIndex::insert(NodeID a, NodeID b, EdgeID edge) {
+    if ((count + 1) * 2 > keys.size()) {
+        rehash(std::max<size_t>(16, keys.size() * 2));
+    }
+    unsigned long long key = pack(a, b);
+    size_t i = slot(key);
 
-    for (const auto& affiliationConnections : connections) {
-        const auto& affconnections = affiliationConnections.second;
-        for (const auto& newconnection : affconnections) {
-            auto duplicateIt = std::find_if(all_connections.begin(), all_connections.end(),
-                [&](const Connection& connection) {
-                    return newconnection == connection || compare_connection_affs_inverted(newconnection, connection);
-                });
-
-            if (duplicateIt == all_connections.end()) {
-                if (newconnection.aff1 < newconnection.aff2) {
-                    all_connections.push_back(newconnection);
-                } else {
-                    all_connections.push_back(search_inverted_connection(newconnection));
-                }
-            }
+    while (keys[i] != EMPTY) {
+        i = (i + 1) & (keys.size() - 1);
+    }
+    keys[i] = key;
+    values[i] = edge;
+    ++count;
+}
+
+void EdgeIndex::erase(NodeID a, NodeID b) {
+    if (keys.empty()) {
+        return;
+    }
+    unsigned long long key = pack(a, b);
+    size_t mask = keys.size() - 1;
+    size_t hole = slot(key);
+
+    while (keys[hole] != key) {
+        if (keys[hole] == EMPTY) {
+            return;
         }
+        hole = (hole + 1) & mask;
     }
-    return all_connections;
+    // Backward shift: later keys of the probe run that would not be found past the
+    // hole are moved into it, so no tombstones are needed
+    for (size_t i = (hole + 1) & mask; keys[i] != EMPTY; i = (i + 1) & mask) {
+        size_t home = slot(keys[i]);
+
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            keys[hole] = keys[i];
+            values[hole] = values[i];
+            hole = i;
+        }
+    }
+    keys[hole] = EMPTY;
+    values[hole] = NO_EDGE;
+    --count;
+}
+
+void EdgeIndex::clear() {
+    keys.clear();
+    values.clear();
+    count = 0;
 }
 
-void Datastructures::find_any_path(AffiliationID current, AffiliationID target,
-                                   std::set<AffiliationID>& visited, Path& path) {
-    visited.insert(current);
+void EdgeIndex::reserve(size_t size) {
+    size_t capacity = std::max<size_t>(16, keys.size());
+
+    while (size * 2 > capacity) {
+        capacity *= 2;
+    }
+    if (capacity != keys.size()) {
+        rehash(capacity);
+    }
+}
 
-    for (const auto& connection : connections[current]) {
-        AffiliationID next_affiliation = (connection.aff1 == current) ? connection.aff2 : connection.aff1;
+void EdgeIndex::rehash(size_t size) {
+    // size has to be a power of two
+    std::vector<unsigned long long> old_keys = std::move(keys);
+    std::vector<EdgeID> old_values = std::move(values);
+    keys.assign(size, EMPTY);
+    values.assign(keys.size(), NO_EDGE);
 
-        if (visited.find(next_affiliation) == visited.end()) {
-            path.push_back(connection);
+    for (size_t j = 0; j < old_keys.size(); ++j) {
+        if (old_keys[j] == EMPTY) {
+            continue;
+        }
+        size_t i = slot(old_keys[j]);
 
-            if (next_affiliation == target) {
-                visited.insert(next_affiliation);
-                return;
-            }
-            find_any_path(next_affiliation, target, visited, path);
+        while (keys[i] != EMPTY) {
+            i = (i + 1) & (keys.size() - 1);
+        }
+        keys[i] = old_keys[j];
+        values[i] = old_values[j];
+    }
+}
+
+void ConnectionGraph::add_node() {
+    delta.emplace_back();
+}
+
+void ConnectionGraph::clear() {
+    offsets.assign(1, 0);
+    targets.clear();
+    edges.clear();
+    delta.clear();
+    delta_size = 0;
+    dead_size = 0;
+    edge_list.clear();
+    index.clear();
+}
+
+void ConnectionGraph::upsert(NodeID aff1, NodeID aff2, Weight weight) {
+    EdgeID edge = index.find(aff1, aff2);
+
+    if (edge != NO_EDGE) {
+        edge_list[edge].weight += weight;
+        return;
+    }
+    edge = edge_list.size();
+    edge_list.push_back({aff1, aff2, weight});
+    index.insert(aff1, aff2, edge);
+
+    delta[aff1].emplace_back(aff2, edge);
+    delta[aff2].emplace_back(aff1, edge);
+    delta_size += 2;
+}
+
+void ConnectionGraph::add_weights(std::vector<GraphEdge> const& weights) {
+    index.reserve(index.count + weights.size());
+    edge_list.reserve(edge_list.size() + weights.size());
+
+    for (const GraphEdge& weight : weights) {
+        upsert(weight.aff1, weight.aff2, weight.weight);
+    }
+    if (delta_size != 0) {
+        merge();
+    }
+}
+
+void ConnectionGraph::add_weight(NodeID aff1, NodeID aff2) {
+    upsert(aff1, aff2, 1);
+    merge_if_needed();
+}
+
+void ConnectionGraph::drop(EdgeID edge) {
+    index.erase(edge_list[edge].aff1, edge_list[edge].aff2);
+    edge_list[edge].weight = 0;
+    dead_size += 2;
+}
+
+bool ConnectionGraph::remove_weight(NodeID aff1, NodeID aff2) {
+    EdgeID edge = index.find(aff1, aff2);
+
+    if (edge == NO_EDGE || --edge_list[edge].weight != 0) {
+        return false;
+    }
+    drop(edge);
+    merge_if_needed();
+    return true;
+}
+
+bool ConnectionGraph::remove_connections(NodeID node) {
+    unsigned int row = row_size(node);
+    unsigned int begin = row != 0 ? offsets[node] : 0;
+    bool removed = false;
+
+    for (unsigned int i = begin; i < begin + row; ++i) {
+        if (edge_list[edges[i]].weight != 0) {
+            drop(edges[i]);
+            removed = true;
+        }
+    }
+    for (const auto& [next, edge] : delta[node]) {
+        if (edge_list[edge].weight != 0) {
+            drop(edge);
+            removed = true;
+        }
+    }
+    merge_if_needed();
+    return removed;
+}
+
+void ConnectionGraph::merge_if_needed() {
+    // Merging costs O(n + e), so it is done only once the buffer holds a fixed
+    // fraction of the graph to keep the cost per added or removed connection constant
+    if (delta_size + dead_size > std::max<size_t>(MIN_DELTA, targets.size() / DELTA_FRACTION)) {
+        merge();
+    }
+}
 
-            if (!path.empty() && path.back() == connection) {
-                path.pop_back();
+void ConnectionGraph::merge() {
+    // Removed connections are dropped and the others renumbered in their old order
+    std::vector<EdgeID> renumbered;
+
+    if (dead_size != 0) {
+        renumbered.assign(edge_list.size(), NO_EDGE);
+        EdgeID live = 0;
+        index.clear();
+        index.reserve(edge_list.size() - dead_size / 2);
+
+        for (EdgeID edge = 0; edge < edge_list.size(); ++edge) {
+            if (edge_list[edge].weight != 0) {
+                edge_list[live] = edge_list[edge];
+                index.insert(edge_list[live].aff1, edge_list[live].aff2, live);
+                renumbered[edge] = live++;
+            }
+        }
+        edge_list.resize(live);
+    }
+    auto current = [&renumbered](EdgeID edge) {
+        return renumbered.empty() ? edge : renumbered[edge];
+    };
+    size_t size = delta.size();
+    std::vector<unsigned int> new_offsets(size + 1, 0);
+
+    for (NodeID node = 0; node < size; ++node) {
+        unsigned int count = delta[node].size();
+        unsigned int row = row_size(node);
+
+        if (dead_size != 0) {
+            count = std::count_if(delta[node].begin(), delta[node].end(), [&](const std::pair<NodeID, EdgeID>& entry) {
+                return current(entry.second) != NO_EDGE;
+            });
+            for (unsigned int i = 0; i < row; ++i) {
+                count += current(edges[offsets[node] + i]) != NO_EDGE;
+            }
+        } else {
+            count += row;
+        }
+        new_offsets[node + 1] = new_offsets[node] + count;
+    }
+    std::vector<NodeID> new_targets(new_offsets[size]);
+    std::vector<EdgeID> new_edges(new_offsets[size]);
+
+    for (NodeID node = 0; node < size; ++node) {
+        unsigned int position = new_offsets[node];
+        unsigned int row = row_size(node);
+        unsigned int begin = row != 0 ? offsets[node] : 0;
+
+        for (unsigned int i = begin; i < begin + row; ++i) {
+            EdgeID edge = current(edges[i]);
+            if (edge != NO_EDGE) {
+                new_targets[position] = targets[i];
+                new_edges[position] = edge;
+                ++position;
+            }
+        }
+        for (const auto& [next, edge] : delta[node]) {
+            if (current(edge) != NO_EDGE) {
+                new_targets[position] = next;
+                new_edges[position] = current(edge);
+                ++position;
             }
         }
+        delta[node].clear();
     }
+    offsets.swap(new_offsets);
+    targets.swap(new_targets);
+    edges.swap(new_edges);
+    delta_size = 0;
+    dead_size = 0;
 }
 
-Path Datastructures::get_any_path(AffiliationID source, AffiliationID target) {
-    auto search1 = is_affiliation(source);
-    auto search2 = is_affiliation(target);
-    Path path;
+bool Datastructures::has_connection(AffiliationID aff1, AffiliationID aff2) {
+    auto search1 = is_affiliation(aff1);
+    auto search2 = is_affiliation(aff2);
 
     if (search1 == nullptr || search2 == nullptr) {
-        return path;
+        return false;
     }
-    std::set<AffiliationID> visited;
-    find_any_path(source, target, visited, path);
-    return path;
+    return graph.find_edge(search1->id, search2->id) != NO_EDGE;
+}
+
+void Datastructures::add_connection(NodeID aff1, NodeID aff2) {
+    if (aff1 == aff2) {
+        return;
+    }
+    if (affiliation_ids.str(aff2) < affiliation_ids.str(aff1)) {
+        std::swap(aff1, aff2);
+    }
+    graph.add_weight(aff1, aff2);
+    friction_forest_stale = true;
+    ++graph_version;
+
+    if (!components_stale) {
+        components.unite(aff1, aff2);
+    }
+}
+
+void Datastructures::add_connections(const std::vector<NodeID>& affiliations) {
+    for (auto it1 = affiliations.begin(); it1 != affiliations.end(); ++it1) {
+        for (auto it2 = std::next(it1); it2 != affiliations.end(); ++it2) {
+            add_connection(*it1, *it2);
+        }
+    }
+}
+
+void Datastructures::remove_connections(const std::vector<NodeID>& affiliations) {
+    for (auto it1 = affiliations.begin(); it1 != affiliations.end(); ++it1) {
+        for (auto it2 = std::next(it1); it2 != affiliations.end(); ++it2) {
+            if (*it1 != *it2) {
+                if (graph.remove_weight(*it1, *it2)) {
+                    components_stale = true;
+                }
+                friction_forest_stale = true;
+                ++graph_version;
+            }
+        }
+    }
+}
+
+bool BulkData::consistent() const {
+    return affiliation_names.size() == affiliation_ids.size()
+        && affiliation_coords.size() == affiliation_ids.size()
+        && publication_titles.size() == publication_ids.size()
+        && publication_years.size() == publication_ids.size()
+        && reference_parents.size() == reference_ids.size()
+        && authorship_publications.size() == authorship_affiliations.size();
 }
 
+bool Datastructures::bulk_load(BulkData const& data)
+{
+    if (!data.consistent()) {
+        return false;
+    }
+    auto lock = write_lock();
+
+    // Rows that fail fail the same way when replayed, so the whole input is logged.
+    // An input too large for one log record is refused before anything is changed.
+    if (!log_operation(LogOp::bulk_load, data.affiliation_ids, data.affiliation_names, data.affiliation_coords,
+                       data.publication_ids, data.publication_titles, data.publication_years,
+                       data.reference_ids, data.reference_parents,
+                       data.authorship_affiliations, data.authorship_publications)) {
+        return false;
+    }
+    bool all_added = true;
+    size_t affiliation_rows = data.affiliation_ids.size();
+    size_t publication_rows = data.publication_ids.size();
+
+    // Tables are sized once for all the rows
+    affiliation_ids.reserve(affiliation_ids.strings.size() + affiliation_rows);
+    names.reserve(names.strings.size() + affiliation_rows);
+    affiliations.reserve(affiliations.size() + affiliation_rows);
+    affiliation_coords.reserve(affiliation_coords.size() + affiliation_rows);
+    publications.reserve(publications.size() + publication_rows);
+
+    for (size_t i = 0; i < affiliation_rows; ++i) {
+        if (create_affiliation(data.affiliation_ids[i], data.affiliation_names[i], data.affiliation_coords[i]) == nullptr) {
+            all_added = false;
+        }
+    }
+    for (size_t i = 0; i < publication_rows; ++i) {
+        if (create_publication(data.publication_ids[i], data.publication_titles[i], data.publication_years[i]) == nullptr) {
+            all_added = false;
+        }
+    }
+
+    // The authorships are applied first, remembering for every publication where
+    // its new affiliations start. The connections are then counted from the
+    // publications all at once.
+    std::unordered_map<Publication*, unsigned int> first_new;
+    std::vector<NodeID> touched;
+    first_new.reserve(data.authorship_publications.size());
+
+    for (size_t i = 0; i < data.authorship_affiliations.size(); ++i) {
+        Affiliation* aff = is_affiliation(data.authorship_affiliations[i]);
+        Publication* pub = is_publication(data.authorship_publications[i]);
+
+        if (aff == nullptr || pub == nullptr) {
+            all_added = false;
+            continue;
+        }
+        first_new.emplace(pub, pub->related_affiliations.size());
+        pub->related_affiliations.push_back(aff->id);
+        aff->publications.push_back(pub);
+        touched.push_back(aff->id);
+    }
+    std::vector<std::pair<Publication*, unsigned int>> sources(first_new.begin(), first_new.end());
+    std::vector<GraphEdge> weights = count_connections(sources);
 
+    if (!weights.empty()) {
+        graph.add_weights(weights);
+        friction_forest_stale = true;
+        ++graph_version;
+
+        if (!components_stale) {
+            for (const GraphEdge& weight : weights) {
+                components.unite(weight.aff1, weight.aff2);
+            }
+        }
+    }
+
+    // Publications of each affiliation are sorted once instead of inserted in place
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+    for (NodeID id : touched) {
+        auto& pubs = affiliations[id]->publications;
+        std::stable_sort(pubs.begin(), pubs.end(), publication_order);
+    }
+
+    for (size_t i = 0; i < data.reference_ids.size(); ++i) {
+        if (!link_reference(data.reference_ids[i], data.reference_parents[i])) {
+            all_added = false;
+        }
+    }
+
+    // The sorted orders are built from scratch once
+    if (affiliation_rows != 0) {
+        std::vector<NodeID> live;
+        live.reserve(affiliation_count);
+
+        for (const Affiliation* aff : affiliations) {
+            if (aff != nullptr) {
+                live.push_back(aff->id);
+            }
+        }
+        affiliations_by_name.build(live);
+        affiliations_by_distance.build(std::move(live));
+    }
+    return all_added;
+}
+
+std::vector<GraphEdge> Datastructures::count_connections(std::vector<std::pair<Publication*, unsigned int>> const& sources)
+{
+    // A publication pairs each of its new affiliations with every affiliation
+    // before it. The pair counts decide how the publications are split.
+    std::vector<size_t> pair_counts(sources.size() + 1, 0);
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+        size_t size = sources[i].first->related_affiliations.size();
+        size_t first = sources[i].second;
+        pair_counts[i + 1] = pair_counts[i] + (size * (size - 1) - first * (first - 1)) / 2;
+    }
+    size_t total = pair_counts.back();
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    size_t threads = std::max<size_t>(1, std::min(hardware, total / MIN_PAIRS_PER_THREAD));
+
+    // Thread t handles the publications from bounds[t] to bounds[t + 1], about
+    // the same number of pairs each
+    std::vector<size_t> bounds(threads + 1, sources.size());
+    bounds[0] = 0;
+    for (size_t t = 1; t < threads; ++t) {
+        bounds[t] = std::lower_bound(pair_counts.begin(), pair_counts.end(), total * t / threads) - pair_counts.begin();
+    }
+
+    // buckets[t][owner] holds the packed pairs emitted by thread t that the owner
+    // thread reduces. A pair always has the same owner, so the owners' results
+    // don't overlap.
+    std::vector<std::vector<std::vector<unsigned long long>>> buckets(threads, std::vector<std::vector<unsigned long long>>(threads));
+    auto owner_of = [threads](unsigned long long key) {
+        return ((key * 0x9e3779b97f4a7c15ULL) >> 32) % threads;
+    };
+    auto emit = [&](size_t t) {
+        for (size_t i = bounds[t]; i < bounds[t + 1]; ++i) {
+            const auto& affs = sources[i].first->related_affiliations;
+
+            for (size_t j = sources[i].second; j < affs.size(); ++j) {
+                for (size_t k = 0; k < j; ++k) {
+                    if (affs[k] != affs[j]) {
+                        unsigned long long key = EdgeIndex::pack(affs[j], affs[k]);
+                        buckets[t][owner_of(key)].push_back(key);
+                    }
+                }
+            }
+        }
+    };
+
+    // Each owner sorts its pairs, and the runs of equal pairs become the weights
+    std::vector<std::vector<GraphEdge>> reduced(threads);
+    auto reduce = [&](size_t owner) {
+        std::vector<unsigned long long> pairs;
+        for (size_t t = 0; t < threads; ++t) {
+            pairs.insert(pairs.end(), buckets[t][owner].begin(), buckets[t][owner].end());
+            std::vector<unsigned long long>().swap(buckets[t][owner]);
+        }
+        std::sort(pairs.begin(), pairs.end());
+
+        for (size_t i = 0; i < pairs.size();) {
+            size_t end = i;
+            while (end < pairs.size() && pairs[end] == pairs[i]) {
+                ++end;
+            }
+            NodeID aff1 = pairs[i] >> 32;
+            NodeID aff2 = pairs[i] & std::numeric_limits<NodeID>::max();
+
+            if (affiliation_ids.str(aff2) < affiliation_ids.str(aff1)) {
+                std::swap(aff1, aff2);
+            }
+            reduced[owner].push_back({aff1, aff2, static_cast<Weight>(end - i)});
+            i = end;
+        }
+    };
+    auto run = [threads](auto&& func) {
+        if (threads == 1) {
+            func(0);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back(func, t);
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    };
+    run(emit);
+    run(reduce);
+
+    // The owners' runs are merged by the packed pair, so the result and the edge
+    // IDs given to new connections don't depend on the number of threads
+    std::vector<GraphEdge> weights;
+    std::vector<size_t> runs = {0};
+    for (auto& part : reduced) {
+        weights.insert(weights.end(), part.begin(), part.end());
+        runs.push_back(weights.size());
+    }
+    auto by_pair = [](const GraphEdge& a, const GraphEdge& b) {
+        return EdgeIndex::pack(a.aff1, a.aff2) < EdgeIndex::pack(b.aff1, b.aff2);
+    };
+    for (size_t width = 1; width < threads; width *= 2) {
+        for (size_t i = 0; i + width < threads; i += 2 * width) {
+            size_t end = std::min(i + 2 * width, threads);
+            std::inplace_merge(weights.begin() + runs[i], weights.begin() + runs[i + width], weights.begin() + runs[end], by_pair);
+        }
+    }
+    return weights;
+}
+
+std::vector<Connection> Datastructures::get_connected_affiliations(AffiliationID id)
+{
+    auto lock = read_lock();
+    std::vector<Connection> connected_affiliations;
+    auto search = is_affiliation(id);
+
+    if (search == nullptr) {
+        return connected_affiliations;
+    }
+    graph.for_each_neighbour(search->id, [&](NodeID next, Weight weight) {
+        connected_affiliations.push_back({affiliation_ids.str(search->id), affiliation_ids.str(next), weight});
+    });
+    return connected_affiliations;
+}
+
+bool Datastructures::for_each_connected_affiliation(AffiliationID id, std::function<void(const AffiliationID&, const AffiliationID&, Weight)> const& visitor)
+{
+    auto lock = read_lock();
+    auto search = is_affiliation(id);
+
+    if (search == nullptr) {
+        return false;
+    }
+    const AffiliationID& source = affiliation_ids.str(search->id);
+
+    graph.for_each_neighbour(search->id, [&](NodeID next, Weight weight) {
+        visitor(source, affiliation_ids.str(next), weight);
+    });
+    return true;
+}
+
+std::vector<Connection> Datastructures::get_all_connections() {
+    auto lock = read_lock();
+    std::vector<Connection> all_connections;
+    all_connections.reserve(graph.size());
+
+    for (const auto& edge : graph.edge_list) {
+        if (edge.weight != 0) {
+            all_connections.push_back({affiliation_ids.str(edge.aff1), affiliation_ids.str(edge.aff2), edge.weight});
+        }
+    }
+    return all_connections;
+}
+
+void Datastructures::for_each_connection(std::function<void(const AffiliationID&, const AffiliationID&, Weight)> const& visitor)
+{
+    auto lock = read_lock();
+    for (const auto& edge : graph.edge_list) {
+        if (edge.weight != 0) {
+            visitor(affiliation_ids.str(edge.aff1), affiliation_ids.str(edge.aff2), edge.weight);
+        }
+    }
+}
+
+Path Datastructures::find_any_path(SearchBuffers& buffers, NodeID source_node, NodeID target_node) {
+    prepare_buffers(buffers);
+    unsigned int stamp = buffers.stamp;
+
+    // Depth first search with an explicit stack, the depth buffer holds the
+    // index of the next neighbour to try for every node on the stack
+    auto& stack = buffers.source_frontier;
+    auto& next_index = buffers.source_depth;
+
+    buffers.source_mark[source_node] = stamp;
+    buffers.source_parent[source_node] = NO_NODE;
+    next_index[source_node] = 0;
+    stack.assign(1, source_node);
+
+    while (!stack.empty()) {
+        NodeID node = stack.back();
+
+        if (next_index[node] == graph.degree(node)) {
+            stack.pop_back();
+            continue;
+        }
+        auto [next, weight] = graph.neighbour(node, next_index[node]++);
+
+        if (buffers.source_mark[next] == stamp || weight == 0) {
+            continue;
+        }
+        buffers.source_mark[next] = stamp;
+        buffers.source_parent[next] = node;
+        buffers.source_weight[next] = weight;
+
+        if (next == target_node) {
+            buffers.target_parent[target_node] = NO_NODE;
+            return build_path(buffers, target_node);
+        }
+        next_index[next] = 0;
+        stack.push_back(next);
+    }
+    return {};
+}
+
+Path Datastructures::get_any_path(AffiliationID source, AffiliationID target) {
+    auto lock = read_lock();
+    BufferLease lease(*this);
+    SearchBuffers& buffers = *lease.buffers;
+    auto search1 = is_affiliation(source);
+    auto search2 = is_affiliation(target);
+
+    if (search1 == nullptr || search2 == nullptr || search1 == search2) {
+        return {};
+    }
+    if (!connected(search1->id, search2->id)) {
+        return {};
+    }
+    Path path;
+
+    if (cached_path(PathCache::Query::any, search1->id, search2->id, path)) {
+        return path;
+    }
+    path = find_any_path(buffers, search1->id, search2->id);
+    cache_path(PathCache::Query::any, search1->id, search2->id, path);
+    return path;
+}
+
+void Datastructures::refresh_components() {
+    std::lock_guard<std::mutex> rebuild(rebuild_mutex);
+
+    if (!components_stale) {
+        return;
+    }
+    components.reset(affiliations.size());
+
+    for (const GraphEdge& edge : graph.edge_list) {
+        if (edge.weight != 0) {
+            components.unite(edge.aff1, edge.aff2);
+        }
+    }
+    components.flatten();
+    components_stale = false;
+}
+
+bool Datastructures::connected(NodeID aff1, NodeID aff2) {
+    refresh_components();
+    return components.root(aff1) == components.root(aff2);
+}
+
+bool Datastructures::same_component(AffiliationID aff1, AffiliationID aff2)
+{
+    auto lock = read_lock();
+    auto search1 = is_affiliation(aff1);
+    auto search2 = is_affiliation(aff2);
+
+    if (search1 == nullptr || search2 == nullptr) {
+        return false;
+    }
+    return connected(search1->id, search2->id);
+}
+
+unsigned int Datastructures::get_component_size(AffiliationID id)
+{
+    auto lock = read_lock();
+    auto search = is_affiliation(id);
+
+    if (search == nullptr) {
+        return 0;
+    }
+    refresh_components();
+    return components.sizes[components.root(search->id)];
+}
+
+ComponentStats Datastructures::get_component_stats()
+{
+    auto lock = read_lock();
+    ComponentStats stats;
+    refresh_components();
+
+    // Removed affiliations are left without connections, so they are sets of their own
+    for (const Affiliation* aff : affiliations) {
+        if (aff == nullptr || components.root(aff->id) != aff->id) {
+            continue;
+        }
+        unsigned int size = components.sizes[aff->id];
+        ++stats.count;
+        stats.largest = std::max(stats.largest, size);
+
+        if (size == 1) {
+            ++stats.isolated;
+        }
+    }
+    return stats;
+}
+
+void Datastructures::prepare_buffers(SearchBuffers& buffers) {
+    size_t size = affiliations.size();
+
+    if (buffers.source_mark.size() < size) {
+        buffers.source_mark.resize(size, 0);
+        buffers.source_depth.resize(size);
+        buffers.source_parent.resize(size);
+        buffers.source_weight.resize(size);
+        buffers.target_mark.resize(size, 0);
+        buffers.target_depth.resize(size);
+        buffers.target_parent.resize(size);
+        buffers.target_weight.resize(size);
+        buffers.cost.resize(size);
+        buffers.queue.resize(size);
+        buffers.target_cost.resize(size);
+        buffers.target_queue.resize(size);
+    }
+    ++buffers.stamp;
+
+    // Stamp wrapped around, old marks could be mistaken for current ones
+    if (buffers.stamp == 0) {
+        std::fill(buffers.source_mark.begin(), buffers.source_mark.end(), 0);
+        std::fill(buffers.target_mark.begin(), buffers.target_mark.end(), 0);
+        buffers.stamp = 1;
+    }
+}
+
+Path Datastructures::build_path(SearchBuffers& buffers, NodeID meet) {
+    Path path;
+
+    // Source side is walked from the meeting node backwards, so it's reversed afterwards
+    for (NodeID node = meet; buffers.source_parent[node] != NO_NODE; node = buffers.source_parent[node]) {
+        NodeID parent = buffers.source_parent[node];
+        path.push_back({affiliation_ids.str(parent), affiliation_ids.str(node), buffers.source_weight[node]});
+    }
+    std::reverse(path.begin(), path.end());
+
+    for (NodeID node = meet; buffers.target_parent[node] != NO_NODE; node = buffers.target_parent[node]) {
+        NodeID parent = buffers.target_parent[node];
+        path.push_back({affiliation_ids.str(node), affiliation_ids.str(parent), buffers.target_weight[node]});
+    }
+    return path;
+}
+
+NodeID Datastructures::search_least_affiliations(SearchBuffers& buffers, NodeID source_node, NodeID target_node, Weight min_weight) {
+    prepare_buffers(buffers);
+    unsigned int stamp = buffers.stamp;
+
+    buffers.source_mark[source_node] = stamp;
+    buffers.source_depth[source_node] = 0;
+    buffers.source_parent[source_node] = NO_NODE;
+    buffers.target_mark[target_node] = stamp;
+    buffers.target_depth[target_node] = 0;
+    buffers.target_parent[target_node] = NO_NODE;
+
+    buffers.source_frontier.assign(1, source_node);
+    buffers.target_frontier.assign(1, target_node);
+
+    NodeID meet = NO_NODE;
+    unsigned int best = std::numeric_limits<unsigned int>::max();
+
+    // Expand a whole level of the smaller frontier at a time. The first level where the
+    // searches meet contains the shortest path, so the best meeting of that level is kept.
+    while (meet == NO_NODE && !buffers.source_frontier.empty() && !buffers.target_frontier.empty()) {
+        bool forward = buffers.source_frontier.size() <= buffers.target_frontier.size();
+
+        auto& frontier = forward ? buffers.source_frontier : buffers.target_frontier;
+        auto& mark = forward ? buffers.source_mark : buffers.target_mark;
+        auto& depth = forward ? buffers.source_depth : buffers.target_depth;
+        auto& parent = forward ? buffers.source_parent : buffers.target_parent;
+        auto& weight = forward ? buffers.source_weight : buffers.target_weight;
+        auto& other_mark = forward ? buffers.target_mark : buffers.source_mark;
+        auto& other_depth = forward ? buffers.target_depth : buffers.source_depth;
+
+        buffers.next_frontier.clear();
+
+        for (NodeID node : frontier) {
+            graph.for_each_neighbour(node, [&](NodeID next, Weight edge_weight) {
+                if (mark[next] == stamp || edge_weight < min_weight) {
+                    return;
+                }
+                mark[next] = stamp;
+                depth[next] = depth[node] + 1;
+                parent[next] = node;
+                weight[next] = edge_weight;
+                buffers.next_frontier.push_back(next);
+
+                if (other_mark[next] == stamp && depth[next] + other_depth[next] < best) {
+                    best = depth[next] + other_depth[next];
+                    meet = next;
+                }
+            });
+        }
+        frontier.swap(buffers.next_frontier);
+    }
+    return meet;
+}
+
+Path Datastructures::get_path_with_least_affiliations(AffiliationID source, AffiliationID target)
+{
+    auto lock = read_lock();
+    BufferLease lease(*this);
+    SearchBuffers& buffers = *lease.buffers;
+    auto search1 = is_affiliation(source);
+    auto search2 = is_affiliation(target);
+
+    if (search1 == nullptr || search2 == nullptr || search1 == search2) {
+        return {};
+    }
+    if (!connected(search1->id, search2->id)) {
+        return {};
+    }
+    Path path;
+
+    if (cached_path(PathCache::Query::least_affiliations, search1->id, search2->id, path)) {
+        return path;
+    }
+    NodeID meet = search_least_affiliations(buffers, search1->id, search2->id, 0);
+
+    if (meet == NO_NODE) {
+        return {};
+    }
+    path = build_path(buffers, meet);
+    cache_path(PathCache::Query::least_affiliations, search1->id, search2->id, path);
+    return path;
+}
+
+void NodeHeap::resize(size_t size) {
+    keys.resize(size);
+    position.resize(size, NOT_IN_HEAP);
+}
+
+void NodeHeap::push(NodeID node, double key) {
+    keys[node] = key;
+    position[node] = heap.size();
+    heap.push_back(node);
+    sift_up(position[node]);
+}
+
+void NodeHeap::decrease(NodeID node, double key) {
+    keys[node] = key;
+    sift_up(position[node]);
+}
+
+NodeID NodeHeap::pop() {
+    NodeID top = heap.front();
+    position[top] = NOT_IN_HEAP;
+
+    if (heap.size() > 1) {
+        heap.front() = heap.back();
+        position[heap.front()] = 0;
+        heap.pop_back();
+        sift_down(0);
+    } else {
+        heap.pop_back();
+    }
+    return top;
+}
+
+void NodeHeap::clear() {
+    for (NodeID node : heap) {
+        position[node] = NOT_IN_HEAP;
+    }
+    heap.clear();
+}
+
+void NodeHeap::sift_up(unsigned int index) {
+    NodeID node = heap[index];
+
+    while (index > 0) {
+        unsigned int parent = (index - 1) / ARITY;
+        if (keys[heap[parent]] <= keys[node]) {
+            break;
+        }
+        heap[index] = heap[parent];
+        position[heap[index]] = index;
+        index = parent;
+    }
+    heap[index] = node;
+    position[node] = index;
+}
+
+void NodeHeap::sift_down(unsigned int index) {
+    NodeID node = heap[index];
+    unsigned int size = heap.size();
+
+    while (true) {
+        unsigned int first = index * ARITY + 1;
+        if (first >= size) {
+            break;
+        }
+        unsigned int last = std::min(first + ARITY, size);
+        unsigned int smallest = first;
+
+        for (unsigned int child = first + 1; child < last; ++child) {
+            if (keys[heap[child]] < keys[heap[smallest]]) {
+                smallest = child;
+            }
+        }
+        if (keys[node] <= keys[heap[smallest]]) {
+            break;
+        }
+        heap[index] = heap[smallest];
+        position[heap[index]] = index;
+        index = smallest;
+    }
+    heap[index] = node;
+    position[node] = index;
+}
+
+PathWithDist Datastructures::get_shortest_path(AffiliationID source, AffiliationID target)
+{
+    auto lock = read_lock();
+    BufferLease lease(*this);
+    SearchBuffers& buffers = *lease.buffers;
+    auto search1 = is_affiliation(source);
+    auto search2 = is_affiliation(target);
+
+    if (search1 == nullptr || search2 == nullptr || search1 == search2) {
+        return {};
+    }
+    if (!connected(search1->id, search2->id)) {
+        return {};
+    }
+    PathWithDist path_with_dist;
+
+    if (cached_path(search1->id, search2->id, path_with_dist)) {
+        return path_with_dist;
+    }
+    prepare_buffers(buffers);
+
+    bool found = hierarchy_enabled && hierarchy.built && hierarchy.version == graph_version
+                 && hierarchy_shortest_path(buffers, search1->id, search2->id, path_with_dist);
+
+    if (!found) {
+        // The hierarchy search marked nodes with the current stamp
+        prepare_buffers(buffers);
+        path_with_dist = astar_shortest_path(buffers, search1->id, search2->id);
+    }
+    cache_path(search1->id, search2->id, path_with_dist);
+    return path_with_dist;
+}
+
+PathWithDist Datastructures::astar_shortest_path(SearchBuffers& buffers, NodeID source_node, NodeID target_node) {
+    unsigned int stamp = buffers.stamp;
+    Coord target_pos = affiliations[target_node]->pos;
+    NodeHeap& queue = buffers.queue;
+
+    buffers.source_mark[source_node] = stamp;
+    buffers.source_parent[source_node] = NO_NODE;
+    buffers.cost[source_node] = 0;
+    queue.push(source_node, distance(affiliations[source_node]->pos, target_pos));
+
+    // A*: straight line distance never overestimates the remaining path length
+    bool found = false;
+    while (!queue.empty()) {
+        NodeID node = queue.pop();
+
+        if (node == target_node) {
+            found = true;
+            break;
+        }
+        const Coord& pos = affiliations[node]->pos;
+
+        graph.for_each_neighbour(node, [&](NodeID next, Weight edge_weight) {
+            double cost = buffers.cost[node] + distance(pos, affiliations[next]->pos);
+
+            if (buffers.source_mark[next] != stamp) {
+                buffers.source_mark[next] = stamp;
+                buffers.cost[next] = cost;
+                buffers.source_parent[next] = node;
+                buffers.source_weight[next] = edge_weight;
+                queue.push(next, cost + distance(affiliations[next]->pos, target_pos));
+            } else if (cost < buffers.cost[next] && queue.contains(next)) {
+                buffers.cost[next] = cost;
+                buffers.source_parent[next] = node;
+                buffers.source_weight[next] = edge_weight;
+                queue.decrease(next, cost + distance(affiliations[next]->pos, target_pos));
+            }
+        });
+    }
+    queue.clear();
+
+    if (!found) {
+        return {};
+    }
+    // The parents lead from the target back to the source, so the path is reversed afterwards
+    PathWithDist path_with_dist;
+
+    for (NodeID node = target_node; buffers.source_parent[node] != NO_NODE; node = buffers.source_parent[node]) {
+        NodeID parent = buffers.source_parent[node];
+        Distance dist = static_cast<Distance>(distance(affiliations[parent]->pos, affiliations[node]->pos));
+        path_with_dist.emplace_back(Connection{affiliation_ids.str(parent), affiliation_ids.str(node), buffers.source_weight[node]}, dist);
+    }
+    std::reverse(path_with_dist.begin(), path_with_dist.end());
+    return path_with_dist;
+}
+
+bool Datastructures::cached_path(PathCache::Query query, NodeID source_node, NodeID target_node, Path& path) {
+    std::lock_guard<std::mutex> guard(path_cache_mutex);
+
+    if (path_cache.budget == 0) {
+        return false;
+    }
+    path_cache.sync(graph_version);
+    const PathCache::Entry* entry = path_cache.find({query, source_node, target_node});
+
+    if (entry == nullptr) {
+        return false;
+    }
+    path = entry->path;
+    return true;
+}
+
+bool Datastructures::cached_path(NodeID source_node, NodeID target_node, PathWithDist& path) {
+    std::lock_guard<std::mutex> guard(path_cache_mutex);
+
+    if (path_cache.budget == 0) {
+        return false;
+    }
+    path_cache.sync(graph_version);
+    const PathCache::Entry* entry = path_cache.find({PathCache::Query::shortest, source_node, target_node});
+
+    if (entry == nullptr) {
+        return false;
+    }
+    path.reserve(entry->path.size());
+    for (size_t i = 0; i < entry->path.size(); ++i) {
+        path.emplace_back(entry->path[i], entry->distances[i]);
+    }
+    return true;
+}
+
+void Datastructures::cache_path(PathCache::Query query, NodeID source_node, NodeID target_node, Path const& path) {
+    std::lock_guard<std::mutex> guard(path_cache_mutex);
+
+    if (path_cache.budget != 0) {
+        path_cache.insert({query, source_node, target_node}, path, {});
+    }
+}
+
+void Datastructures::cache_path(NodeID source_node, NodeID target_node, PathWithDist const& path) {
+    std::lock_guard<std::mutex> guard(path_cache_mutex);
+
+    if (path_cache.budget == 0) {
+        return;
+    }
+    Path connections;
+    std::vector<Distance> distances;
+    connections.reserve(path.size());
+    distances.reserve(path.size());
+
+    for (const auto& [connection, dist] : path) {
+        connections.push_back(connection);
+        distances.push_back(dist);
+    }
+    path_cache.insert({PathCache::Query::shortest, source_node, target_node}, std::move(connections), std::move(distances));
+}
+
+void Datastructures::set_path_cache_budget(size_t bytes)
+{
+    auto lock = write_lock();
+    path_cache.set_budget(bytes);
+}
+
+PathCacheStats Datastructures::get_path_cache_stats()
+{
+    auto lock = read_lock();
+    std::lock_guard<std::mutex> guard(path_cache_mutex);
+    PathCacheStats stats;
+    stats.hits = path_cache.hits;
+    stats.misses = path_cache.misses;
+    stats.entries = path_cache.entries.size();
+    stats.bytes = path_cache.bytes;
+    stats.budget = path_cache.budget;
+    return stats;
+}
+
+void PathCache::sync(unsigned long long graph_version) {
+    if (version != graph_version) {
+        clear();
+        version = graph_version;
+    }
+}
+
+const PathCache::Entry* PathCache::find(Key const& key) {
+    auto search = index.find(key);
+
+    if (search == index.end()) {
+        ++misses;
+        return nullptr;
+    }
+    ++hits;
+    entries.splice(entries.begin(), entries, search->second);
+    return &entries.front();
+}
+
+void PathCache::insert(Key const& key, Path path, std::vector<Distance> distances) {
+    // Two queries missing at the same time both insert the same result
+    if (index.find(key) != index.end()) {
+        return;
+    }
+    size_t entry_bytes = sizeof(Entry) + sizeof(std::pair<const Key, std::list<Entry>::iterator>)
+        + 2 * sizeof(void*) + path.capacity() * sizeof(Connection) + distances.capacity() * sizeof(Distance);
+
+    // Strings longer than the small string buffer are on the heap
+    size_t inline_capacity = AffiliationID().capacity();
+
+    for (const Connection& connection : path) {
+        for (const AffiliationID* id : {&connection.aff1, &connection.aff2}) {
+            if (id->capacity() > inline_capacity) {
+                entry_bytes += id->capacity() + 1;
+            }
+        }
+    }
+    if (entry_bytes > budget) {
+        return;
+    }
+    entries.push_front({key, std::move(path), std::move(distances), entry_bytes});
+    index.emplace(key, entries.begin());
+    bytes += entry_bytes;
+    evict();
+}
+
+void PathCache::set_budget(size_t new_budget) {
+    budget = new_budget;
+    evict();
+}
+
+void PathCache::clear() {
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+void PathCache::evict() {
+    while (bytes > budget) {
+        bytes -= entries.back().bytes;
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+void Datastructures::use_contraction_hierarchy(bool enabled)
+{
+    auto lock = write_lock();
+    hierarchy_enabled = enabled;
+}
+
+void Datastructures::rebuild_contraction_hierarchy()
+{
+    ContractionHierarchy rebuilt;
+    std::vector<std::vector<ContractionHierarchy::Arc>> arcs;
+    {
+        auto lock = read_lock();
+        arcs = ContractionHierarchy::graph_arcs(graph, affiliations);
+        rebuilt.version = graph_version;
+    }
+    // The contraction works on its own copy without a lock
+    rebuilt.build(std::move(arcs));
+    auto lock = write_lock();
+
+    // A hierarchy of an older graph would never be used
+    if (rebuilt.version == graph_version) {
+        std::swap(hierarchy, rebuilt);
+    }
+}
+
+bool Datastructures::contraction_hierarchy_ready()
+{
+    auto lock = read_lock();
+    return hierarchy_enabled && hierarchy.built && hierarchy.version == graph_version;
+}
+
+bool Datastructures::hierarchy_shortest_path(SearchBuffers& buffers, NodeID source_node, NodeID target_node, PathWithDist& path_with_dist) {
+    unsigned int stamp = buffers.stamp;
+    NodeHeap& source_queue = buffers.queue;
+    NodeHeap& target_queue = buffers.target_queue;
+
+    buffers.source_mark[source_node] = stamp;
+    buffers.source_parent[source_node] = NO_NODE;
+    buffers.cost[source_node] = 0;
+    source_queue.push(source_node, 0);
+    buffers.target_mark[target_node] = stamp;
+    buffers.target_parent[target_node] = NO_NODE;
+    buffers.target_cost[target_node] = 0;
+    target_queue.push(target_node, 0);
+
+    // Both searches only go up, so they can't stop at the first node they share. A side
+    // stops once its nearest node is farther than the best path found so far.
+    double best = std::numeric_limits<double>::infinity();
+    NodeID meet = NO_NODE;
+
+    while (true) {
+        bool source_open = !source_queue.empty() && source_queue.top_key() < best;
+        bool target_open = !target_queue.empty() && target_queue.top_key() < best;
+
+        if (!source_open && !target_open) {
+            break;
+        }
+        bool forward = source_open && (!target_open || source_queue.top_key() <= target_queue.top_key());
+        NodeHeap& queue = forward ? source_queue : target_queue;
+        auto& mark = forward ? buffers.source_mark : buffers.target_mark;
+        auto& parent = forward ? buffers.source_parent : buffers.target_parent;
+        auto& cost = forward ? buffers.cost : buffers.target_cost;
+        auto& other_mark = forward ? buffers.target_mark : buffers.source_mark;
+        auto& other_cost = forward ? buffers.target_cost : buffers.cost;
+
+        NodeID node = queue.pop();
+
+        if (other_mark[node] == stamp && cost[node] + other_cost[node] < best) {
+            best = cost[node] + other_cost[node];
+            meet = node;
+        }
+        for (auto arc = hierarchy.begin(node); arc != hierarchy.end(node); ++arc) {
+            double next_cost = cost[node] + arc->length;
+
+            if (mark[arc->target] != stamp) {
+                mark[arc->target] = stamp;
+                cost[arc->target] = next_cost;
+                parent[arc->target] = node;
+                queue.push(arc->target, next_cost);
+            } else if (next_cost < cost[arc->target] && queue.contains(arc->target)) {
+                cost[arc->target] = next_cost;
+                parent[arc->target] = node;
+                queue.decrease(arc->target, next_cost);
+            }
+        }
+    }
+    source_queue.clear();
+    target_queue.clear();
+
+    if (meet == NO_NODE) {
+        return false;
+    }
+
+    // Arcs of the upward path from the source, then of the downward path to the target
+    std::vector<NodeID> turns;
+    for (NodeID node = meet; node != NO_NODE; node = buffers.source_parent[node]) {
+        turns.push_back(node);
+    }
+    std::reverse(turns.begin(), turns.end());
+    for (NodeID node = buffers.target_parent[meet]; node != NO_NODE; node = buffers.target_parent[node]) {
+        turns.push_back(node);
+    }
+
+    std::vector<NodeID> nodes{source_node};
+    for (size_t i = 1; i < turns.size(); ++i) {
+        if (!hierarchy.unpack(turns[i - 1], turns[i], nodes)) {
+            return false;
+        }
+    }
+
+    path_with_dist.clear();
+    path_with_dist.reserve(nodes.size() - 1);
+
+    for (size_t i = 1; i < nodes.size(); ++i) {
+        NodeID from = nodes[i - 1];
+        NodeID to = nodes[i];
+        EdgeID edge = graph.find_edge(from, to);
+
+        if (edge == NO_EDGE) {
+            path_with_dist.clear();
+            return false;
+        }
+        Distance dist = static_cast<Distance>(distance(affiliations[from]->pos, affiliations[to]->pos));
+        path_with_dist.emplace_back(Connection{affiliation_ids.str(from), affiliation_ids.str(to), graph.edge_list[edge].weight}, dist);
+    }
+    return true;
+}
+
+std::vector<std::vector<ContractionHierarchy::Arc>> ContractionHierarchy::graph_arcs(ConnectionGraph const& graph, std::vector<Affiliation*> const& nodes) {
+    std::vector<std::vector<Arc>> arcs(nodes.size());
+
+    for (NodeID node = 0; node < nodes.size(); ++node) {
+        graph.for_each_neighbour(node, [&](NodeID next, Weight) {
+            arcs[node].push_back({next, NO_NODE, distance(nodes[node]->pos, nodes[next]->pos)});
+        });
+    }
+    return arcs;
+}
+
+void ContractionHierarchy::build(std::vector<std::vector<Arc>> remaining) {
+    // Remaining graph, the arcs to a node are removed as it is contracted
+    size_t size = remaining.size();
+
+    std::vector<double> witness_cost(size);
+    std::vector<unsigned int> witness_mark(size, 0);
+    unsigned int witness_stamp = 0;
+    NodeHeap witness_queue;
+    witness_queue.resize(size);
+
+    auto add_arc = [&](NodeID from, NodeID to, NodeID middle, double length) {
+        for (Arc& arc : remaining[from]) {
+            if (arc.target == to) {
+                if (length < arc.length) {
+                    arc.middle = middle;
+                    arc.length = length;
+                }
+                return;
+            }
+        }
+        remaining[from].push_back({to, middle, length});
+    };
+
+    // Counts the shortcuts contracting the node needs, and adds them if apply is set.
+    // A pair of neighbours needs one unless a search around the node finds a path
+    // at most as long. The search is bounded, so a shortcut may be added needlessly.
+    auto contract = [&](NodeID node, bool apply) {
+        const std::vector<Arc>& around = remaining[node];
+        unsigned int shortcuts = 0;
+
+        for (size_t i = 0; i + 1 < around.size(); ++i) {
+            NodeID from = around[i].target;
+            double limit = 0;
+            for (size_t j = i + 1; j < around.size(); ++j) {
+                limit = std::max(limit, around[i].length + around[j].length);
+            }
+
+            if (++witness_stamp == 0) {
+                std::fill(witness_mark.begin(), witness_mark.end(), 0);
+                witness_stamp = 1;
+            }
+            witness_mark[from] = witness_stamp;
+            witness_cost[from] = 0;
+            witness_queue.push(from, 0);
+
+            for (unsigned int settled = 0; !witness_queue.empty() && settled < WITNESS_LIMIT; ++settled) {
+                NodeID current = witness_queue.pop();
+
+                for (const Arc& arc : remaining[current]) {
+                    double cost = witness_cost[current] + arc.length;
+
+                    if (arc.target == node || cost > limit) {
+                        continue;
+                    }
+                    if (witness_mark[arc.target] != witness_stamp) {
+                        witness_mark[arc.target] = witness_stamp;
+                        witness_cost[arc.target] = cost;
+                        witness_queue.push(arc.target, cost);
+                    } else if (cost < witness_cost[arc.target] && witness_queue.contains(arc.target)) {
+                        witness_cost[arc.target] = cost;
+                        witness_queue.decrease(arc.target, cost);
+                    }
+                }
+            }
+            witness_queue.clear();
+
+            for (size_t j = i + 1; j < around.size(); ++j) {
+                NodeID to = around[j].target;
+                double length = around[i].length + around[j].length;
+
+                if (witness_mark[to] == witness_stamp && witness_cost[to] <= length) {
+                    continue;
+                }
+                ++shortcuts;
+                if (apply) {
+                    add_arc(from, to, node, length);
+                    add_arc(to, from, node, length);
+                }
+            }
+        }
+        return shortcuts;
+    };
+
+    // Least important first: few shortcuts compared to the arcs removed, and neighbours
+    // contracted already, which spreads the contraction evenly over the graph
+    std::vector<unsigned int> contracted_neighbours(size, 0);
+    auto priority = [&](NodeID node) {
+        return static_cast<long long>(contract(node, false)) - static_cast<long long>(remaining[node].size())
+            + contracted_neighbours[node];
+    };
+    using Entry = std::pair<long long, NodeID>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> order;
+
+    for (NodeID node = 0; node < size; ++node) {
+        order.emplace(priority(node), node);
+    }
+
+    std::vector<std::vector<Arc>> upward(size);
+    rank.assign(size, 0);
+    unsigned int next_rank = 0;
+
+    while (!order.empty()) {
+        NodeID node = order.top().second;
+        order.pop();
+
+        // Priorities are updated lazily, a node whose priority grew waits for its turn again
+        long long current = priority(node);
+        if (!order.empty() && current > order.top().first) {
+            order.emplace(current, node);
+            continue;
+        }
+        contract(node, true);
+        rank[node] = next_rank++;
+
+        for (const Arc& arc : remaining[node]) {
+            auto& arcs_of_next = remaining[arc.target];
+            arcs_of_next.erase(std::find_if(arcs_of_next.begin(), arcs_of_next.end(), [node](const Arc& back) {
+                return back.target == node;
+            }));
+            ++contracted_neighbours[arc.target];
+        }
+        upward[node] = std::move(remaining[node]);
+        remaining[node] = {};
+    }
+
+    offsets.assign(size + 1, 0);
+    arcs.clear();
+
+    for (NodeID node = 0; node < size; ++node) {
+        offsets[node] = arcs.size();
+        arcs.insert(arcs.end(), upward[node].begin(), upward[node].end());
+    }
+    offsets[size] = arcs.size();
+    built = true;
+}
+
+void ContractionHierarchy::clear() {
+    built = false;
+    rank.clear();
+    offsets.clear();
+    arcs.clear();
+}
+
+const ContractionHierarchy::Arc* ContractionHierarchy::find_arc(NodeID a, NodeID b) const {
+    // The arc is kept by the endpoint contracted first
+    if (rank[b] < rank[a]) {
+        std::swap(a, b);
+    }
+    const Arc* arc = std::find_if(begin(a), end(a), [b](const Arc& arc) { return arc.target == b; });
+    return arc != end(a) ? arc : nullptr;
+}
+
+bool ContractionHierarchy::unpack(NodeID a, NodeID b, std::vector<NodeID>& nodes) const {
+    // A shortcut stands for the two arcs to its middle node, which may be shortcuts as well
+    std::vector<std::pair<NodeID, NodeID>> pending{{a, b}};
+
+    while (!pending.empty()) {
+        auto [from, to] = pending.back();
+        pending.pop_back();
+        const Arc* arc = find_arc(from, to);
+
+        if (arc == nullptr) {
+            return false;
+        }
+        NodeID middle = arc->middle;
+
+        if (middle == NO_NODE) {
+            nodes.push_back(to);
+        } else {
+            pending.emplace_back(middle, to);
+            pending.emplace_back(from, middle);
+        }
+    }
+    return true;
+}
+
+void DisjointSets::reset(size_t size) {
+    parent.resize(size);
+    sizes.assign(size, 1);
+
+    for (NodeID node = 0; node < size; ++node) {
+        parent[node] = node;
+    }
+}
+
+void DisjointSets::add() {
+    parent.push_back(parent.size());
+    sizes.push_back(1);
+}
+
+NodeID DisjointSets::root(NodeID node) const {
+    while (parent[node] != node) {
+        node = parent[node];
+    }
+    return node;
+}
+
+void DisjointSets::flatten() {
+    for (NodeID node = 0; node < parent.size(); ++node) {
+        parent[node] = find(node);
+    }
+}
+
+NodeID DisjointSets::find(NodeID node) {
+    // Path halving
+    while (parent[node] != node) {
+        parent[node] = parent[parent[node]];
+        node = parent[node];
+    }
+    return node;
+}
+
+bool DisjointSets::unite(NodeID a, NodeID b) {
+    a = find(a);
+    b = find(b);
+
+    if (a == b) {
+        return false;
+    }
+    if (sizes[a] < sizes[b]) {
+        std::swap(a, b);
+    }
+    parent[b] = a;
+    sizes[a] += sizes[b];
+    return true;
+}
+
+void Datastructures::use_friction_forest(bool enabled)
+{
+    auto lock = write_lock();
+    friction_forest_enabled = enabled;
+}
+
+void Datastructures::build_friction_forest() {
+    size_t size = affiliations.size();
+
+    // Kruskal with the heaviest connections first gives a maximum spanning forest
+    std::vector<std::tuple<Weight, NodeID, NodeID>> edges;
+
+    for (NodeID node = 0; node < size; ++node) {
+        graph.for_each_neighbour(node, [&](NodeID next, Weight weight) {
+            if (node < next) {
+                edges.emplace_back(weight, node, next);
+            }
+        });
+    }
+    std::sort(edges.begin(), edges.end(), [](const auto& e1, const auto& e2) {
+        return std::get<0>(e1) > std::get<0>(e2);
+    });
+
+    DisjointSets sets;
+    sets.reset(size);
+    std::vector<std::vector<std::pair<NodeID, Weight>>> tree(size);
+
+    for (const auto& [weight, node1, node2] : edges) {
+        if (sets.unite(node1, node2)) {
+            tree[node1].emplace_back(node2, weight);
+            tree[node2].emplace_back(node1, weight);
+        }
+    }
+
+    // Root every tree so that a path can be found by climbing from both ends
+    forest_parent.assign(size, NO_NODE);
+    forest_weight.assign(size, NO_WEIGHT);
+    forest_depth.assign(size, 0);
+    std::vector<bool> seen(size, false);
+    std::vector<NodeID> queue;
+
+    for (NodeID root = 0; root < size; ++root) {
+        if (seen[root]) {
+            continue;
+        }
+        seen[root] = true;
+        queue.assign(1, root);
+
+        for (size_t i = 0; i < queue.size(); ++i) {
+            NodeID node = queue[i];
+            for (const auto& [next, weight] : tree[node]) {
+                if (!seen[next]) {
+                    seen[next] = true;
+                    forest_parent[next] = node;
+                    forest_weight[next] = weight;
+                    forest_depth[next] = forest_depth[node] + 1;
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+    friction_forest_stale = false;
+}
+
+Weight Datastructures::friction_forest_bottleneck(NodeID source_node, NodeID target_node) {
+    if (source_node >= forest_parent.size() || target_node >= forest_parent.size()) {
+        return NO_WEIGHT;
+    }
+    Weight widest = std::numeric_limits<Weight>::max();
+
+    while (forest_depth[source_node] > forest_depth[target_node]) {
+        widest = std::min(widest, forest_weight[source_node]);
+        source_node = forest_parent[source_node];
+    }
+    while (forest_depth[target_node] > forest_depth[source_node]) {
+        widest = std::min(widest, forest_weight[target_node]);
+        target_node = forest_parent[target_node];
+    }
+    while (source_node != target_node) {
+        // Both reached the roots of different trees
+        if (forest_parent[source_node] == NO_NODE) {
+            return NO_WEIGHT;
+        }
+        widest = std::min({widest, forest_weight[source_node], forest_weight[target_node]});
+        source_node = forest_parent[source_node];
+        target_node = forest_parent[target_node];
+    }
+    return widest;
+}
+
+Path Datastructures::get_path_of_least_friction(AffiliationID source, AffiliationID target)
+{
+    auto lock = read_lock();
+    BufferLease lease(*this);
+    SearchBuffers& buffers = *lease.buffers;
+    auto search1 = is_affiliation(source);
+    auto search2 = is_affiliation(target);
+
+    if (search1 == nullptr || search2 == nullptr || search1 == search2) {
+        return {};
+    }
+    if (!connected(search1->id, search2->id)) {
+        return {};
+    }
+    NodeID source_node = search1->id;
+    NodeID target_node = search2->id;
+
+    // Friction of a connection is the inverse of its weight, so the path of least friction
+    // maximises the smallest weight on the path. First find that bottleneck weight, then the
+    // path with least affiliations using only connections at least that heavy.
+    Weight widest = NO_WEIGHT;
+
+    if (friction_forest_enabled) {
+        {
+            std::lock_guard<std::mutex> rebuild(rebuild_mutex);
+            if (friction_forest_stale) {
+                build_friction_forest();
+            }
+        }
+        widest = friction_forest_bottleneck(source_node, target_node);
+    } else {
+        widest = widest_path_bottleneck(buffers, source_node, target_node);
+    }
+
+    if (widest == NO_WEIGHT) {
+        return {};
+    }
+    NodeID meet = search_least_affiliations(buffers, source_node, target_node, widest);
+    return build_path(buffers, meet);
+}
+
+Weight Datastructures::widest_path_bottleneck(SearchBuffers& buffers, NodeID source_node, NodeID target_node) {
+    prepare_buffers(buffers);
+    unsigned int stamp = buffers.stamp;
+    NodeHeap& queue = buffers.queue;
+    auto& bottleneck = buffers.source_weight;
+
+    buffers.source_mark[source_node] = stamp;
+    bottleneck[source_node] = std::numeric_limits<Weight>::max();
+    queue.push(source_node, -static_cast<double>(bottleneck[source_node]));
+
+    Weight widest = NO_WEIGHT;
+    while (!queue.empty()) {
+        NodeID node = queue.pop();
+
+        if (node == target_node) {
+            widest = bottleneck[node];
+            break;
+        }
+        graph.for_each_neighbour(node, [&](NodeID next, Weight edge_weight) {
+            Weight width = std::min(bottleneck[node], edge_weight);
+
+            if (buffers.source_mark[next] != stamp) {
+                buffers.source_mark[next] = stamp;
+                bottleneck[next] = width;
+                queue.push(next, -static_cast<double>(width));
+            } else if (width > bottleneck[next] && queue.contains(next)) {
+                bottleneck[next] = width;
+                queue.decrease(next, -static_cast<double>(width));
+            }
+        });
+    }
+    queue.clear();
+    return widest;
+}
+
+bool Datastructures::save_snapshot(std::string const& path)
+{
+    auto lock = read_lock();
+    std::string image = snapshot_image();
+
+    // The image is complete, so the file is written without holding up changes
+    if (lock.owns_lock()) {
+        lock.unlock();
+    }
+    return replace_file(path, image);
+}
+
+std::string Datastructures::snapshot_image()
+{
+    std::string image;
+    SnapshotWriter out{image};
+
+    image.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    out.put(SNAPSHOT_VERSION);
+    out.put(SNAPSHOT_BYTE_ORDER);
+    out.put(log_lsn);
+
+    out.put<unsigned int>(affiliation_ids.strings.size());
+    for (const std::string* id : affiliation_ids.strings) {
+        out.put_string(*id);
+    }
+
+    out.put<unsigned int>(affiliation_count);
+    for (const Affiliation* aff : affiliations) {
+        if (aff != nullptr) {
+            out.put(aff->id);
+            out.put_string(names.str(aff->name));
+            out.put(aff->pos.x);
+            out.put(aff->pos.y);
+        }
+    }
+
+    std::vector<const Publication*> by_year;
+    by_year.reserve(publications.size());
+    for (const auto& [id, pub] : publications) {
+        by_year.push_back(pub);
+    }
+    std::sort(by_year.begin(), by_year.end(), publication_order);
+
+    size_t reference_count = 0;
+    out.put<unsigned int>(by_year.size());
+    for (const Publication* pub : by_year) {
+        out.put(pub->id);
+        out.put_string(pub->title);
+        out.put(pub->year);
+        out.put<unsigned int>(pub->related_affiliations.size());
+        for (NodeID aff : pub->related_affiliations) {
+            out.put(aff);
+        }
+        reference_count += pub->references.size();
+    }
+
+    out.put<unsigned int>(reference_count);
+    for (const auto& [id, pub] : publications) {
+        for (const Publication* reference : pub->references) {
+            out.put(reference->id);
+            out.put(id);
+        }
+    }
+
+    out.put<unsigned int>(graph.size());
+    for (const GraphEdge& edge : graph.edge_list) {
+        if (edge.weight != 0) {
+            out.put(edge.aff1);
+            out.put(edge.aff2);
+            out.put(edge.weight);
+        }
+    }
+
+    for (const OrderedIndex* order : {&affiliations_by_name, &affiliations_by_distance}) {
+        std::vector<NodeID> handles = order->range(0, order->size());
+        out.put<unsigned int>(handles.size());
+        for (NodeID handle : handles) {
+            out.put(handle);
+        }
+    }
+    return image;
+}
+
+bool Datastructures::load_snapshot(std::string const& path)
+{
+    auto lock = write_lock();
+    detach_log();
+
+#ifdef __unix__
+    // The file is mapped rather than read, so it isn't copied into a buffer first.
+    // Queries aren't served from the mapping: every table is decoded into the
+    // datastructure before returning, and the mapping is dropped.
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    ::madvise(mapping, size, MADV_SEQUENTIAL);
+    const char* begin = static_cast<const char*>(mapping);
+#else
+    std::ifstream file(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!file && !file.eof()) {
+        return false;
+    }
+    size_t size = contents.size();
+    const char* begin = contents.data();
+#endif
+
+    bool loaded = load_image(begin, size);
+
+#ifdef __unix__
+    ::munmap(mapping, size);
+#endif
+    return loaded;
+}
+
+bool Datastructures::load_image(const char* begin, size_t size)
+{
+    SnapshotReader in{begin, begin + size};
+
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    for (char& c : magic) {
+        c = in.get<char>();
+    }
+    if (std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0
+        || in.get<unsigned int>() != SNAPSHOT_VERSION
+        || in.get<unsigned int>() != SNAPSHOT_BYTE_ORDER) {
+        return false;
+    }
+    unsigned long long lsn = in.get<unsigned long long>();
+
+    if (!in.ok) {
+        return false;
+    }
+    // From here on a broken file leaves the datastructure empty
+    clear_data();
+
+    // IDs are interned in handle order, so the handles in the file are valid as such
+    unsigned int id_count = in.get<unsigned int>();
+    affiliation_ids.reserve(id_count);
+    for (unsigned int i = 0; i < id_count && in.ok; ++i) {
+        affiliation_ids.intern(in.get_string());
+    }
+    if (!in.ok || affiliation_ids.strings.size() != id_count) {
+        clear_data();
+        return false;
+    }
+    affiliations.assign(id_count, nullptr);
+    for (unsigned int i = 0; i < id_count; ++i) {
+        graph.add_node();
+    }
+
+    unsigned int affiliation_rows = in.get<unsigned int>();
+    affiliation_coords.reserve(affiliation_rows);
+    for (unsigned int i = 0; i < affiliation_rows && in.ok; ++i) {
+        NodeID handle = in.get<NodeID>();
+        std::string name = in.get_string();
+        Coord xy;
+        xy.x = in.get<int>();
+        xy.y = in.get<int>();
+
+        if (!in.ok || handle >= id_count || create_affiliation(affiliation_ids.str(handle), name, xy) == nullptr) {
+            in.ok = false;
+        }
+    }
+
+    unsigned int publication_rows = in.get<unsigned int>();
+    publications.reserve(publication_rows);
+    for (unsigned int i = 0; i < publication_rows && in.ok; ++i) {
+        PublicationID id = in.get<PublicationID>();
+        std::string title = in.get_string();
+        Year year = in.get<Year>();
+        Publication* pub = in.ok ? create_publication(id, title, year) : nullptr;
+
+        if (pub == nullptr) {
+            in.ok = false;
+            break;
+        }
+        unsigned int count = in.get<unsigned int>();
+        for (unsigned int j = 0; j < count && in.ok; ++j) {
+            NodeID handle = in.get<NodeID>();
+
+            if (handle >= id_count || affiliations[handle] == nullptr) {
+                in.ok = false;
+                break;
+            }
+            pub->related_affiliations.push_back(handle);
+            affiliations[handle]->publications.push_back(pub);
+        }
+    }
+
+    unsigned int reference_rows = in.get<unsigned int>();
+    for (unsigned int i = 0; i < reference_rows && in.ok; ++i) {
+        PublicationID id = in.get<PublicationID>();
+        PublicationID parentid = in.get<PublicationID>();
+
+        if (!in.ok || !link_reference(id, parentid)) {
+            in.ok = false;
+        }
+    }
+
+    unsigned int edge_rows = in.get<unsigned int>();
+    std::vector<GraphEdge> weights;
+    weights.reserve(in.ok ? edge_rows : 0);
+    for (unsigned int i = 0; i < edge_rows && in.ok; ++i) {
+        GraphEdge edge;
+        edge.aff1 = in.get<NodeID>();
+        edge.aff2 = in.get<NodeID>();
+        edge.weight = in.get<Weight>();
+
+        if (edge.aff1 >= id_count || edge.aff2 >= id_count) {
+            in.ok = false;
+        }
+        weights.push_back(edge);
+    }
+
+    // The orders are checked in one pass instead of sorted
+    std::vector<NodeID> orders[2];
+    OrderedIndex* indexes[2] = {&affiliations_by_name, &affiliations_by_distance};
+    for (int i = 0; i < 2 && in.ok; ++i) {
+        unsigned int count = in.get<unsigned int>();
+        if (count != affiliation_count) {
+            in.ok = false;
+            break;
+        }
+        orders[i].reserve(count);
+        for (unsigned int j = 0; j < count && in.ok; ++j) {
+            NodeID handle = in.get<NodeID>();
+
+            if (handle >= id_count || affiliations[handle] == nullptr
+                || (j > 0 && !indexes[i]->less(orders[i].back(), handle))) {
+                in.ok = false;
+            }
+            orders[i].push_back(handle);
+        }
+    }
+    for (Affiliation* aff : affiliations) {
+        if (in.ok && aff != nullptr
+            && !std::is_sorted(aff->publications.begin(), aff->publications.end(), publication_order)) {
+            in.ok = false;
+        }
+    }
+    if (!in.ok || in.pos != in.end) {
+        clear_data();
+        return false;
+    }
+    graph.add_weights(weights);
+    affiliations_by_name.build_sorted(orders[0]);
+    affiliations_by_distance.build_sorted(orders[1]);
+    log_lsn = lsn;
+    return true;
+}
+
+bool Datastructures::open_log(std::string const& path, size_t group_bytes)
+{
+    auto lock = write_lock();
+    detach_log();
+    log_file = std::fopen(path.c_str(), "ab");
+    log_path = path;
+    log_group_bytes = group_bytes;
+    return log_file != nullptr;
+}
+
+bool Datastructures::checkpoint(std::string const& snapshot_path)
+{
+    auto lock = write_lock();
+
+    if (log_file == nullptr) {
+        return false;
+    }
+    // The records not yet written are in the image as well
+    std::string image = snapshot_image();
+    std::string group;
+    group.swap(log_buffer);
+    log_group_full = false;
+    unsigned long long turn = log_groups_taken++;
+
+    // Changes and queries go on while the snapshot is saved. Groups filled meanwhile
+    // have later turns, so they are written after the log is emptied.
+    if (lock.lock.owns_lock()) {
+        lock.lock.unlock();
+    }
+    lock.released = true;
+    auto writing = wait_log_turn(turn);
+
+    if (!replace_file(snapshot_path, image)) {
+        write_log_records(group);
+        end_log_turn(writing);
+        return false;
+    }
+    // The snapshot is on disk, so a crash from here on only finds records it already has
+    std::error_code error;
+    std::fflush(log_file);
+    std::filesystem::resize_file(log_path, 0, error);
+#ifdef __unix__
+    bool emptied = !error && ::fsync(::fileno(log_file)) == 0;
+#else
+    bool emptied = !error;
+#endif
+    end_log_turn(writing);
+    return emptied;
+}
+
+bool Datastructures::flush_log()
+{
+    auto lock = write_lock();
+    return write_log_group(lock);
+}
+
+void Datastructures::close_log()
+{
+    auto lock = write_lock();
+    detach_log();
+}
+
+bool Datastructures::write_log_group(WriteLock& lock)
+{
+    log_group_full = false;
+
+    if (log_file == nullptr) {
+        return false;
+    }
+    std::string group;
+    group.swap(log_buffer);
+    unsigned long long turn = log_groups_taken++;
+
+    // Queries and the next change go on while the group waits for its turn and is
+    // on its way to the disk
+    if (lock.lock.owns_lock()) {
+        lock.lock.unlock();
+    }
+    lock.released = true;
+    auto writing = wait_log_turn(turn);
+    bool written = write_log_records(group);
+    end_log_turn(writing);
+    return written;
+}
+
+std::unique_lock<std::mutex> Datastructures::wait_log_turn(unsigned long long turn)
+{
+    std::unique_lock<std::mutex> writing(log_mutex);
+    log_turn.wait(writing, [this, turn] { return log_groups_written == turn; });
+    return writing;
+}
+
+void Datastructures::end_log_turn(std::unique_lock<std::mutex>& writing)
+{
+    ++log_groups_written;
+    writing.unlock();
+    log_turn.notify_all();
+}
+
+bool Datastructures::write_log_records(std::string const& group)
+{
+    bool written = std::fwrite(group.data(), 1, group.size(), log_file) == group.size()
+                   && std::fflush(log_file) == 0;
+#ifdef __unix__
+    written = written && ::fsync(::fileno(log_file)) == 0;
+#endif
+    return written;
+}
+
+void Datastructures::detach_log()
+{
+    if (log_file == nullptr) {
+        return;
+    }
+    // Groups taken before still have the file, the last records go after them
+    auto writing = wait_log_turn(log_groups_taken++);
+    write_log_records(log_buffer);
+    log_buffer.clear();
+    log_group_full = false;
+    std::fclose(log_file);
+    log_file = nullptr;
+    end_log_turn(writing);
+}
+
+bool Datastructures::recover(std::string const& snapshot_path, std::string const& log_path)
+{
+    close_log();
+
+    // Without a snapshot the log holds the whole history
+    if (std::ifstream(snapshot_path).good()) {
+        if (!load_snapshot(snapshot_path)) {
+            return false;
+        }
+    } else {
+        clear_all();
+        log_lsn = 0;
+    }
+    std::error_code error;
+    size_t log_size = std::filesystem::file_size(log_path, error);
+    if (error) {
+        return true;
+    }
+    std::ifstream file(log_path, std::ios::binary);
+    std::string record;
+    size_t valid_size = 0;
+
+    // Records are read one at a time, a record is at most the size of the rest of the file
+    while (valid_size + sizeof(unsigned int) <= log_size) {
+        unsigned int length = 0;
+        unsigned int checksum = 0;
+        file.read(reinterpret_cast<char*>(&length), sizeof(length));
+
+        if (!file || log_size - valid_size - sizeof(unsigned int) < size_t(length) + sizeof(checksum)) {
+            break;
+        }
+        record.resize(length);
+        file.read(record.data(), length);
+        file.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+
+        if (!file || checksum != record_checksum(record.data(), length)) {
+            break;
+        }
+        SnapshotReader in{record.data(), record.data() + length};
+        unsigned long long lsn = in.get<unsigned long long>();
+        LogOp op = in.get<LogOp>();
+
+        // Changes already in the snapshot are skipped
+        if (lsn > log_lsn) {
+            if (!in.ok || !replay_record(op, in)) {
+                break;
+            }
+            log_lsn = lsn;
+        }
+        valid_size += sizeof(unsigned int) + length + sizeof(checksum);
+    }
+
+    // A torn tail is cut off so that new records aren't written after it
+    file.close();
+    if (valid_size != log_size) {
+        std::filesystem::resize_file(log_path, valid_size, error);
+    }
+    return !error;
+}
+
+bool Datastructures::replay_record(LogOp op, SnapshotReader& in)
+{
+    AffiliationID affiliationid;
+    Name name;
+    Coord xy;
+    PublicationID id;
+    PublicationID parentid;
+    Year year;
+    std::vector<AffiliationID> affiliationids;
+    BulkData data;
+
+    switch (op) {
+    case LogOp::clear_all:
+        if (!in.complete()) {
+            return false;
+        }
+        clear_all();
+        return true;
+    case LogOp::add_affiliation:
+        in.get_field(affiliationid);
+        in.get_field(name);
+        in.get_field(xy);
+        if (!in.complete()) {
+            return false;
+        }
+        add_affiliation(affiliationid, name, xy);
+        return true;
+    case LogOp::change_affiliation_coord:
+        in.get_field(affiliationid);
+        in.get_field(xy);
+        if (!in.complete()) {
+            return false;
+        }
+        change_affiliation_coord(affiliationid, xy);
+        return true;
+    case LogOp::add_publication:
+        in.get_field(id);
+        in.get_field(name);
+        in.get_field(year);
+        in.get_field(affiliationids);
+        if (!in.complete()) {
+            return false;
+        }
+        add_publication(id, name, year, affiliationids);
+        return true;
+    case LogOp::add_reference:
+        in.get_field(id);
+        in.get_field(parentid);
+        if (!in.complete()) {
+            return false;
+        }
+        add_reference(id, parentid);
+        return true;
+    case LogOp::add_affiliation_to_publication:
+        in.get_field(affiliationid);
+        in.get_field(id);
+        if (!in.complete()) {
+            return false;
+        }
+        add_affiliation_to_publication(affiliationid, id);
+        return true;
+    case LogOp::remove_affiliation:
+        in.get_field(affiliationid);
+        if (!in.complete()) {
+            return false;
+        }
+        remove_affiliation(affiliationid);
+        return true;
+    case LogOp::remove_publication:
+        in.get_field(id);
+        if (!in.complete()) {
+            return false;
+        }
+        remove_publication(id);
+        return true;
+    case LogOp::bulk_load:
+        in.get_field(data.affiliation_ids);
+        in.get_field(data.affiliation_names);
+        in.get_field(data.affiliation_coords);
+        in.get_field(data.publication_ids);
+        in.get_field(data.publication_titles);
+        in.get_field(data.publication_years);
+        in.get_field(data.reference_ids);
+        in.get_field(data.reference_parents);
+        in.get_field(data.authorship_affiliations);
+        in.get_field(data.authorship_publications);
+        if (!in.complete()) {
+            return false;
+        }
+        bulk_load(data);
+        return true;
+    }
+    return false;
+}
+
+StringHandle InternTable::intern(std::string const& str) {
+    auto [it, inserted] = handles.emplace(str, strings.size());
+
+    if (inserted) {
+        strings.push_back(&it->first);
+    }
+    return it->second;
+}
+
+StringHandle InternTable::find(std::string const& str) const {
+    auto it = handles.find(str);
+
+    if (it == handles.end()) {
+        return NO_HANDLE;
+    }
+    return it->second;
+}
+
+void InternTable::reserve(size_t size) {
+    handles.reserve(size);
+    strings.reserve(size);
+}
+
+void InternTable::clear() {
+    handles.clear();
+    strings.clear();
+}
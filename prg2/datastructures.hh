@@ -12,6 +12,16 @@
 #include <limits>
 #include <functional>
 #include <set>
+#include <unordered_map>
+#include <list>
+#include <new>
+#include <type_traits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 
 // Types for IDs
 using AffiliationID = std::string;
@@ -22,6 +32,12 @@ using Weight = int;
 struct Connection;
 // Type for a distance (in arbitrary units)
 using Distance = int;
+// Handle of an interned string
+using StringHandle = unsigned int;
+// Interned affiliation ID, also the index of the affiliation in the connection graph
+using NodeID = StringHandle;
+// Index of a connection in the connection graph
+using EdgeID = unsigned int;
 
 using Path = std::vector<Connection>;
 using PathWithDist = std::vector<std::pair<Connection,Distance>>;
@@ -32,6 +48,9 @@ PublicationID const NO_PUBLICATION = -1;
 Name const NO_NAME = "!NO_NAME!";
 Year const NO_YEAR = -1;
 Weight const NO_WEIGHT = -1;
+NodeID const NO_NODE = std::numeric_limits<NodeID>::max();
+StringHandle const NO_HANDLE = std::numeric_limits<NodeID>::max();
+EdgeID const NO_EDGE = std::numeric_limits<EdgeID>::max();
 
 // Return value for cases where integer values were not found
 int const NO_VALUE = std::numeric_limits<int>::min();
@@ -43,28 +62,132 @@ struct Coord
     int y = NO_VALUE;
 };
 
+// Table of interned strings. Every distinct string is stored once and referred to
+// by a 32-bit handle, handles are given out in order starting from 0. Internal
+// structures keep only handles and strings are looked up at the API boundary.
+struct InternTable
+{
+    std::unordered_map<std::string, StringHandle> handles;
+    std::vector<const std::string*> strings;
+
+    StringHandle intern(std::string const& str);
+    StringHandle find(std::string const& str) const;
+    std::string const& str(StringHandle handle) const { return *strings[handle]; }
+    void reserve(size_t size);
+    void clear();
+};
+
 // Struct for publication
 struct Publication {
     PublicationID id;
     Name title;
     Year year;
 
-    std::vector<AffiliationID> related_affiliations;
+    std::vector<NodeID> related_affiliations;
 
     std::vector<Publication*> references;
     Publication* referencer = nullptr;
+
+    // Ancestor index: distance to the root of the reference tree and a jump
+    // pointer to an ancestor higher up, the root jumps to itself
+    unsigned int depth = 0;
+    Publication* jump = nullptr;
+
+    // Position in the preorder layout of the reference trees and the number of
+    // publications in the subtree, the publication itself included
+    unsigned int layout_index = 0;
+    unsigned int layout_size = 1;
 };
 
-//Struct for affiliation
+//Struct for affiliation. The interned ID is also the node of the affiliation
+// in the connection graph.
 struct Affiliation {
-    AffiliationID id;
-    Name name;
+    NodeID id;
+    StringHandle name;
     Coord pos;
 
+    // Kept ordered by year, equal years by publication ID
     std::vector<Publication*> publications;
 };
 
 
+// Slab allocator for the entities. Objects are built in fixed size chunks, so
+// their addresses stay stable, and the slots of destroyed objects are reused.
+// reset() ends the lifetime of every object at once but keeps the chunks, so
+// refilling the structure after clear_all doesn't go back to the allocator.
+template <typename Type>
+class Slab
+{
+public:
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    Slab() = default;
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    ~Slab()
+    {
+        reset();
+        for (Slot* chunk : chunks) {
+            delete[] chunk;
+        }
+    }
+
+    template <typename... Args>
+    Type* create(Args&&... args)
+    {
+        Slot* slot;
+
+        if (!free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            if (used == chunks.size() * CHUNK_SIZE) {
+                chunks.push_back(new Slot[CHUNK_SIZE]);
+            }
+            slot = &chunks[used / CHUNK_SIZE][used % CHUNK_SIZE];
+            ++used;
+        }
+        Type* object = new (slot->storage) Type{std::forward<Args>(args)...};
+        slot->live = true;
+        return object;
+    }
+
+    void destroy(Type* object)
+    {
+        // Storage is the first member of the slot, so the object's address is the slot's
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        object->~Type();
+        slot->live = false;
+        free_slots.push_back(slot);
+    }
+
+    void reset()
+    {
+        if constexpr (!std::is_trivially_destructible_v<Type>) {
+            for (size_t i = 0; i < used; ++i) {
+                Slot& slot = chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+                if (slot.live) {
+                    reinterpret_cast<Type*>(slot.storage)->~Type();
+                }
+            }
+        }
+        used = 0;
+        free_slots.clear();
+    }
+
+private:
+    struct Slot
+    {
+        alignas(Type) unsigned char storage[sizeof(Type)];
+        bool live = false;
+    };
+
+    std::vector<Slot*> chunks;
+    std::vector<Slot*> free_slots;
+    size_t used = 0;
+};
+
 // Example: Defining == and hash function for Coord so that it can be used
 // as key for std::unordered_map/set, if needed
 inline bool operator==(Coord c1, Coord c2) { return c1.x == c2.x && c1.y == c2.y; }
@@ -94,6 +217,88 @@ inline bool operator<(Coord c1, Coord c2)
 // Return value for cases where coordinates were not found
 Coord const NO_COORD = {NO_VALUE, NO_VALUE};
 
+// Squared distance between two points. It can take 65 bits, so it is kept as the
+// carry and the low 64 bits, which compare like the exact value.
+using SquaredDistance = std::pair<bool, unsigned long long>;
+
+inline SquaredDistance squared_distance(Coord a, Coord b)
+{
+    // The differences are widened first, they take up to 33 bits
+    unsigned long long dx = std::llabs(static_cast<long long>(a.x) - b.x);
+    unsigned long long dy = std::llabs(static_cast<long long>(a.y) - b.y);
+    unsigned long long sum = dx * dx + dy * dy;
+    return {sum < dx * dx, sum};
+}
+
+// Uniform grid over the affiliation coordinates for nearest neighbour queries.
+// Cells are kept in a hash map, so only occupied cells take memory. The cell side
+// is picked so that a cell holds a couple of affiliations on average, and the grid
+// is rebuilt with a new side whenever the number of affiliations has doubled or halved.
+struct SpatialGrid
+{
+    static constexpr long long TARGET_PER_CELL = 2;
+    static constexpr size_t MIN_REBUILD = 8;
+
+    std::unordered_map<unsigned long long, std::vector<std::pair<Coord, NodeID>>> cells;
+    long long cell_size = 1;
+    size_t count = 0;
+    size_t built_for = 0;
+
+    // Bounding box of the occupied cells, only grows between rebuilds
+    long long min_x = 0;
+    long long min_y = 0;
+    long long max_x = -1;
+    long long max_y = -1;
+
+    void insert(Coord xy, NodeID id);
+    void erase(Coord xy, NodeID id);
+    void clear();
+    // Closest affiliations by distance, equal distances ordered by smaller y
+    std::vector<NodeID> nearest(Coord xy, size_t k) const;
+
+private:
+    long long cell_of(int value) const;
+    static unsigned long long key(long long cell_x, long long cell_y);
+    void add_to_cell(Coord xy, NodeID id);
+    void rebuild();
+};
+
+// Order statistic tree (treap) over affiliation handles. Every node stores the
+// size of its subtree, so a position in the order is found in O(log n) and a page
+// of the order is read without walking the nodes before it. The handles are the
+// nodes, so the links are flat arrays indexed by handle. The order is given as a
+// comparison of two handles, and an affiliation has to be erased before the data
+// the comparison reads is changed.
+struct OrderedIndex
+{
+    std::function<bool(NodeID, NodeID)> less;
+    NodeID root = NO_NODE;
+    std::vector<NodeID> left;
+    std::vector<NodeID> right;
+    std::vector<unsigned int> sizes;
+
+    explicit OrderedIndex(std::function<bool(NodeID, NodeID)> less) : less(std::move(less)) {}
+    void insert(NodeID id);
+    void erase(NodeID id);
+    void clear();
+    // Replaces the contents with the given handles in O(n log(n)), sorting them
+    // and then building the tree from the sorted order in linear time
+    void build(std::vector<NodeID> ids);
+    // Replaces the contents with handles already in order, in linear time
+    void build_sorted(std::vector<NodeID> const& ids);
+    size_t size() const;
+    // Handles from position offset onwards in order, at most limit of them
+    std::vector<NodeID> range(size_t offset, size_t limit) const;
+
+private:
+    static unsigned int priority(NodeID id);
+    unsigned int size_of(NodeID node) const;
+    void update(NodeID node);
+    NodeID merge(NodeID lower, NodeID upper);
+    void split(NodeID tree, NodeID id, NodeID& lower, NodeID& upper);
+    NodeID erase_from(NodeID tree, NodeID id);
+};
+
 struct Connection
 {
     AffiliationID aff1 = NO_AFFILIATION;
@@ -105,6 +310,306 @@ struct Connection
 };
 const Connection NO_CONNECTION{NO_AFFILIATION,NO_AFFILIATION,NO_WEIGHT};
 
+// Connection stored once in canonical form, aff1 being the affiliation with the
+// smaller ID. Rows of both affiliations in the graph point to the same edge.
+struct GraphEdge
+{
+    NodeID aff1 = NO_NODE;
+    NodeID aff2 = NO_NODE;
+    Weight weight = NO_WEIGHT;
+};
+
+// Open addressing hash map from an unordered pair of nodes to the connection
+// between them. Linear probing over a power of two table kept at most half full.
+struct EdgeIndex
+{
+    static constexpr unsigned long long EMPTY = std::numeric_limits<unsigned long long>::max();
+
+    std::vector<unsigned long long> keys;
+    std::vector<EdgeID> values;
+    size_t count = 0;
+
+    static unsigned long long pack(NodeID a, NodeID b)
+    {
+        if (b < a) {
+            std::swap(a, b);
+        }
+        return (static_cast<unsigned long long>(a) << 32) | b;
+    }
+
+    EdgeID find(NodeID a, NodeID b) const;
+    void insert(NodeID a, NodeID b, EdgeID edge);
+    void erase(NodeID a, NodeID b);
+    void reserve(size_t size);
+    void clear();
+
+private:
+    size_t slot(unsigned long long key) const;
+    void rehash(size_t size);
+};
+
+// Connection graph in compressed sparse row form: the neighbours of node u are
+// targets[offsets[u]] .. targets[offsets[u+1]-1] and the parallel edges array holds
+// the connection of each of them in edge_list. New connections go to a small per-node delta buffer
+// which is merged into the rows once it has grown past a fraction of the graph.
+// A removed connection keeps its place with weight zero and is skipped until the
+// next merge drops it and renumbers the connections after it.
+struct ConnectionGraph
+{
+    static constexpr size_t MIN_DELTA = 1024;
+    static constexpr size_t DELTA_FRACTION = 8;
+
+    std::vector<unsigned int> offsets;
+    std::vector<NodeID> targets;
+    std::vector<EdgeID> edges;
+
+    std::vector<std::vector<std::pair<NodeID, EdgeID>>> delta;
+    size_t delta_size = 0;
+    // Entries of removed connections still in the rows and the delta buffer
+    size_t dead_size = 0;
+
+    std::vector<GraphEdge> edge_list;
+    EdgeIndex index;
+
+    void add_node();
+    void clear();
+    // aff1 has to be the affiliation with the smaller ID
+    void add_weight(NodeID aff1, NodeID aff2);
+    // Adds many weights at once and merges the rows a single time at the end,
+    // every aff1 has to be the affiliation with the smaller ID
+    void add_weights(std::vector<GraphEdge> const& weights);
+    // Takes one from the weight of a connection and removes it when the weight drops to zero,
+    // returns true if it was removed
+    bool remove_weight(NodeID aff1, NodeID aff2);
+    // Removes every connection of the node, returns true if there were any
+    bool remove_connections(NodeID node);
+    void merge();
+
+    // Number of connections
+    size_t size() const { return index.count; }
+
+    EdgeID find_edge(NodeID a, NodeID b) const { return index.find(a, b); }
+
+    unsigned int row_size(NodeID node) const
+    {
+        return node + 1 < offsets.size() ? offsets[node + 1] - offsets[node] : 0;
+    }
+
+    unsigned int degree(NodeID node) const { return row_size(node) + delta[node].size(); }
+
+    std::pair<NodeID, Weight> neighbour(NodeID node, unsigned int index) const
+    {
+        unsigned int row = row_size(node);
+        if (index < row) {
+            return {targets[offsets[node] + index], edge_list[edges[offsets[node] + index]].weight};
+        }
+        const auto& [next, edge] = delta[node][index - row];
+        return {next, edge_list[edge].weight};
+    }
+
+    template <typename Func>
+    void for_each_neighbour(NodeID node, Func func) const
+    {
+        unsigned int row = row_size(node);
+        unsigned int begin = row != 0 ? offsets[node] : 0;
+
+        // Removed connections have weight zero
+        for (unsigned int i = begin; i < begin + row; ++i) {
+            Weight weight = edge_list[edges[i]].weight;
+            if (weight != 0) {
+                func(targets[i], weight);
+            }
+        }
+        for (const auto& [next, edge] : delta[node]) {
+            Weight weight = edge_list[edge].weight;
+            if (weight != 0) {
+                func(next, weight);
+            }
+        }
+    }
+
+private:
+    // Adds to the weight of a connection or creates it, without merging
+    void upsert(NodeID aff1, NodeID aff2, Weight weight);
+    // Marks a connection removed, without merging
+    void drop(EdgeID edge);
+    // Merges once the buffered and removed entries have grown past a fraction of the graph
+    void merge_if_needed();
+};
+
+// Indexed d-ary min-heap of graph nodes. The heap position of every node is
+// stored so that the key of a queued node can be decreased in place.
+struct NodeHeap
+{
+    static constexpr unsigned int ARITY = 4;
+    static constexpr unsigned int NOT_IN_HEAP = std::numeric_limits<unsigned int>::max();
+
+    std::vector<NodeID> heap;
+    std::vector<double> keys;
+    std::vector<unsigned int> position;
+
+    void resize(size_t size);
+    bool empty() const { return heap.empty(); }
+    bool contains(NodeID node) const { return position[node] != NOT_IN_HEAP; }
+    // Key of the node pop would return
+    double top_key() const { return keys[heap.front()]; }
+    void push(NodeID node, double key);
+    void decrease(NodeID node, double key);
+    NodeID pop();
+    void clear();
+
+private:
+    void sift_up(unsigned int index);
+    void sift_down(unsigned int index);
+};
+
+// Union-find over graph nodes with union by size
+struct DisjointSets
+{
+    std::vector<NodeID> parent;
+    std::vector<unsigned int> sizes;
+
+    void reset(size_t size);
+    // Adds a node in a set of its own
+    void add();
+    NodeID find(NodeID node);
+    // Root without path halving, so it can be used by several readers at once
+    NodeID root(NodeID node) const;
+    bool unite(NodeID a, NodeID b);
+    // Points every node straight at its root
+    void flatten();
+};
+
+// Contraction hierarchy of the connection graph, the straight line distances being
+// the lengths. Nodes are contracted one at a time from the least important, and a
+// shortcut is added wherever the only shortest path between two neighbours went
+// through the contracted node. Each node keeps only its arcs to nodes contracted
+// after it, so a query searches upwards from both ends until the searches meet.
+struct ContractionHierarchy
+{
+    // Nodes settled by a witness search before it gives up and adds the shortcut
+    static constexpr unsigned int WITNESS_LIMIT = 64;
+
+    struct Arc
+    {
+        NodeID target = NO_NODE;
+        // Node skipped by a shortcut, NO_NODE for a connection of the graph
+        NodeID middle = NO_NODE;
+        double length = 0;
+    };
+
+    bool built = false;
+    // Datastructures::graph_version the hierarchy was built from
+    unsigned long long version = 0;
+    std::vector<unsigned int> rank;
+    std::vector<unsigned int> offsets;
+    std::vector<Arc> arcs;
+
+    // Arcs of every node of the graph with their lengths, the input of build
+    static std::vector<std::vector<Arc>> graph_arcs(ConnectionGraph const& graph, std::vector<Affiliation*> const& nodes);
+    void build(std::vector<std::vector<Arc>> remaining);
+    void clear();
+    // The upward arcs of a node
+    const Arc* begin(NodeID node) const { return arcs.data() + offsets[node]; }
+    const Arc* end(NodeID node) const { return arcs.data() + offsets[node + 1]; }
+    // Appends the graph path the arc between a and b stands for to nodes, without a.
+    // Returns false if an arc is missing, which only a broken build can cause.
+    bool unpack(NodeID a, NodeID b, std::vector<NodeID>& nodes) const;
+
+private:
+    const Arc* find_arc(NodeID a, NodeID b) const;
+};
+
+// Buffers for the graph searches, kept between calls so that a search doesn't
+// allocate once the buffers have grown to the size of the graph. A node counts
+// as visited only if its mark equals the current stamp, so nothing is cleared.
+struct SearchBuffers
+{
+    unsigned int stamp = 0;
+
+    std::vector<unsigned int> source_mark;
+    std::vector<unsigned int> source_depth;
+    std::vector<NodeID> source_parent;
+    std::vector<Weight> source_weight;
+
+    std::vector<unsigned int> target_mark;
+    std::vector<unsigned int> target_depth;
+    std::vector<NodeID> target_parent;
+    std::vector<Weight> target_weight;
+
+    std::vector<NodeID> source_frontier;
+    std::vector<NodeID> target_frontier;
+    std::vector<NodeID> next_frontier;
+
+    std::vector<double> cost;
+    NodeHeap queue;
+
+    // Backward half of the contraction hierarchy query
+    std::vector<double> target_cost;
+    NodeHeap target_queue;
+};
+
+// LRU cache of path query results, keyed by the kind of the query and the nodes at
+// its ends. Every entry is from the same graph version; the cache is emptied when
+// the version changes. The size of an entry is estimated from its connections and
+// their strings, and the least recently used entries go once the budget is exceeded.
+struct PathCache
+{
+    static constexpr size_t DEFAULT_BUDGET = 1 << 24;
+
+    enum class Query : unsigned char { any, least_affiliations, shortest };
+
+    struct Key
+    {
+        Query query;
+        NodeID source;
+        NodeID target;
+
+        bool operator==(Key const& other) const
+        {
+            return query == other.query && source == other.source && target == other.target;
+        }
+    };
+
+    struct KeyHash
+    {
+        std::size_t operator()(Key const& key) const
+        {
+            unsigned long long ends = (static_cast<unsigned long long>(key.source) << 32) | key.target;
+            return std::hash<unsigned long long>()(ends * 3 + static_cast<unsigned char>(key.query));
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        Path path;
+        // Distances of the connections, only for the shortest path
+        std::vector<Distance> distances;
+        size_t bytes = 0;
+    };
+
+    size_t budget = DEFAULT_BUDGET;
+    size_t bytes = 0;
+    unsigned long long version = 0;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+
+    // Empties the cache if it is from another graph version
+    void sync(unsigned long long graph_version);
+    // Marks the entry used and returns it, nullptr if there is none
+    const Entry* find(Key const& key);
+    void insert(Key const& key, Path path, std::vector<Distance> distances);
+    void set_budget(size_t new_budget);
+    void clear();
+
+private:
+    void evict();
+};
 
 // Return value for cases where Distance is unknown
 Distance const NO_DISTANCE = NO_VALUE;
@@ -125,6 +630,54 @@ private:
     std::string msg_;
 };
 
+// Columnar input for Datastructures::bulk_load. Row i of a table is at index i
+// of each of the table's vectors, so the vectors of a table must be equally long.
+struct BulkData
+{
+    // True if the vectors of every table have the same length
+    bool consistent() const;
+
+    std::vector<AffiliationID> affiliation_ids;
+    std::vector<Name> affiliation_names;
+    std::vector<Coord> affiliation_coords;
+
+    std::vector<PublicationID> publication_ids;
+    std::vector<Name> publication_titles;
+    std::vector<Year> publication_years;
+
+    // Publication referenced by the parent, as in add_reference
+    std::vector<PublicationID> reference_ids;
+    std::vector<PublicationID> reference_parents;
+
+    // Affiliation added to the publication, as in add_affiliation_to_publication
+    std::vector<AffiliationID> authorship_affiliations;
+    std::vector<PublicationID> authorship_publications;
+};
+
+// Reads the binary records of snapshots and the operation log
+struct SnapshotReader;
+
+// Result of Datastructures::get_component_stats
+struct ComponentStats
+{
+    // Number of groups of affiliations connected to each other
+    unsigned int count = 0;
+    unsigned int largest = 0;
+    // Affiliations without any connections
+    unsigned int isolated = 0;
+};
+
+// Result of Datastructures::get_path_cache_stats
+struct PathCacheStats
+{
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned int entries = 0;
+    // Estimated memory used by the entries and the budget for it, in bytes
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
 // This is the class you are supposed to implement
 
 class Datastructures
@@ -145,6 +698,12 @@ public:
     // Short rationale for estimate:
     std::vector<AffiliationID> get_all_affiliations();
 
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Same pass as get_all_affiliations without copying the IDs.
+    // The IDs passed to the visitor refer to the interned IDs and are valid until clear_all,
+    // load_snapshot or recover is called.
+    void for_each_affiliation(std::function<void(const AffiliationID&)> const& visitor);
+
     // Estimate of performance:
     // Short rationale for estimate:
     bool add_affiliation(AffiliationID id, Name const& name, Coord xy);
@@ -160,20 +719,28 @@ public:
 
     // We recommend you implement the operations below only after implementing the ones above
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: In-order walk of the kept alphabetical order.
     std::vector<AffiliationID> get_affiliations_alphabetically();
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(log(n) + limit)
+    // Short rationale for estimate: Subtree sizes lead to the offset, then limit nodes are read.
+    std::vector<AffiliationID> get_affiliations_alphabetically(unsigned int offset, unsigned int limit);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: In-order walk of the kept distance order.
     std::vector<AffiliationID> get_affiliations_distance_increasing();
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(log(n) + limit)
+    // Short rationale for estimate: Subtree sizes lead to the offset, then limit nodes are read.
+    std::vector<AffiliationID> get_affiliations_distance_increasing(unsigned int offset, unsigned int limit);
+
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Lookup from an unordered_multimap keyed by the coordinate.
     AffiliationID find_affiliation_with_coord(Coord xy);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(log(n)) on average, O(n) worst case
+    // Short rationale for estimate: Distance order is updated in O(log(n)), the rest with hash lookups.
     bool change_affiliation_coord(AffiliationID id, Coord newcoord);
 
 
@@ -199,16 +766,28 @@ public:
     // Short rationale for estimate:
     std::vector<AffiliationID> get_affiliations(PublicationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(k) on average, k is the number of affiliations of the publication
+    // Short rationale for estimate: The affiliations are passed to the visitor in the order
+    // of get_affiliations. The IDs are valid as in for_each_affiliation. Returns false if
+    // there is no such publication.
+    bool for_each_affiliation_of(PublicationID id, std::function<void(const AffiliationID&)> const& visitor);
+
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Hash lookups, the jump pointer of a leaf is set in constant time.
     bool add_reference(PublicationID id, PublicationID parentid);
 
     // Estimate of performance:
     // Short rationale for estimate:
     std::vector<PublicationID> get_direct_references(PublicationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(k) on average, k is the number of direct references
+    // Short rationale for estimate: The references are passed to the visitor in the order
+    // of get_direct_references. Returns false if there is no such publication.
+    bool for_each_direct_reference(PublicationID id, std::function<void(PublicationID)> const& visitor);
+
+    // Estimate of performance: O(k) on average
+    // Short rationale for estimate: Binary search for the place in the affiliation's k
+    // publications, later ones are shifted by one.
     bool add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid);
 
     // Estimate of performance:
@@ -219,10 +798,18 @@ public:
     // Short rationale for estimate:
     PublicationID get_parent(PublicationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(log(k) + m) on average
+    // Short rationale for estimate: Binary search for the year in the sorted publications,
+    // then the m publications after it are copied.
     std::vector<std::pair<Year, PublicationID>> get_publications_after(AffiliationID affiliationid, Year year);
 
+    // Estimate of performance: O(log(k) + m) on average
+    // Short rationale for estimate: Same search as get_publications_after, the publications
+    // are passed to the visitor in order instead of collected. Returns false if there is
+    // no such affiliation.
+    bool for_each_publication_after(AffiliationID affiliationid, Year year,
+                                    std::function<void(Year, PublicationID)> const& visitor);
+
     // Estimate of performance:
     // Short rationale for estimate:
     std::vector<PublicationID> get_referenced_by_chain(PublicationID id);
@@ -230,24 +817,33 @@ public:
 
     // Non-compulsory operations
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(k), O(n) after changes with the layout in use
+    // Short rationale for estimate: Preorder walk with an explicit stack, k is the number of
+    // references. With the layout the references are copied from one contiguous slice.
     std::vector<PublicationID> get_all_references(PublicationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets a flag. The layout is built in O(n) on the
+    // next get_all_references after the references have changed.
+    void use_reference_layout(bool enabled);
+
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Only the grid cells around the coordinate are read when
+    // the affiliations are evenly spread.
     std::vector<AffiliationID> get_affiliations_closest_to(Coord xy);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(m*k + c + log(n)) amortized, m publications of k affiliations, c connections
+    // Short rationale for estimate: The affiliation is taken out of its own publications and
+    // its connections are marked removed, the rest of the graph isn't visited.
     bool remove_affiliation(AffiliationID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(log(d)), O(n) after a removal or reattaching a subtree
+    // Short rationale for estimate: Jump pointers skip up the chains, d is the depth.
     PublicationID get_closest_common_parent(PublicationID id1, PublicationID id2);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(k^2 + r + m) amortized, k affiliations, r references, m publications per affiliation
+    // Short rationale for estimate: Only the affiliations, references and referencer of the
+    // publication are touched. Every pair of its affiliations loses one from its weight.
     bool remove_publication(PublicationID publicationid);
 
     // PRG 2 functions:
@@ -257,38 +853,307 @@ public:
     // but the worst case is O(n).
     std::vector<Connection> get_connected_affiliations(AffiliationID id);
 
-    // Estimate of performance: O(n^2)
-    // Short rationale for estimate: Two inner for loops through the data.
+    // Estimate of performance: O(k) on average, k is the number of connections of the affiliation
+    // Short rationale for estimate: The connections are passed to the visitor instead of built
+    // into Connections, the IDs are valid as in for_each_connection. Returns false if there
+    // is no such affiliation.
+    bool for_each_connected_affiliation(AffiliationID id, std::function<void(const AffiliationID&, const AffiliationID&, Weight)> const& visitor);
+
+    // Estimate of performance: O(e)
+    // Short rationale for estimate: Every connection is stored once, so they are read in one pass.
     std::vector<Connection> get_all_connections();
 
-    // Estimate of performance: O(n^2)
-    // Short rationale for estimate: The function uses DFS to find the path.
-    // The worst case could be up to O(n^2) if the graph is densely filled.
+    // Estimate of performance: O(e)
+    // Short rationale for estimate: Same pass as get_all_connections without building a vector.
+    // The IDs passed to the visitor refer to the stored affiliations and are valid until the
+    // affiliation is removed or clear_all is called.
+    void for_each_connection(std::function<void(const AffiliationID&, const AffiliationID&, Weight)> const& visitor);
+
+    // Estimate of performance: O(n + e)
+    // Short rationale for estimate: The function uses DFS to find the path, which visits
+    // every affiliation and connection at most once.
     Path get_any_path(AffiliationID source, AffiliationID target);
 
+    // Estimate of performance: O(log(n)), O(n + e) after a connection was removed
+    // Short rationale for estimate: Compares the roots of the two affiliations in the component
+    // index. The index follows added connections as they come and is rebuilt after removals.
+    // The path queries use it to return at once when there is no path.
+    bool same_component(AffiliationID aff1, AffiliationID aff2);
+
+    // Estimate of performance: O(log(n)), O(n + e) after a connection was removed
+    // Short rationale for estimate: Size is kept at the root of the component. Returns 0 if
+    // there is no such affiliation.
+    unsigned int get_component_size(AffiliationID id);
+
+    // Estimate of performance: O(n), O(n + e) after a connection was removed
+    // Short rationale for estimate: Every affiliation's root is read once.
+    ComponentStats get_component_stats();
+
     // PRG2 optional functions
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(n + e)
+    // Short rationale for estimate: Bidirectional BFS visits every affiliation and connection
+    // at most once. Usually much less, because the two searches meet in the middle.
     Path get_path_with_least_affiliations(AffiliationID source, AffiliationID target);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O((n + e) log(n)), O(n + e) with the friction forest
+    // Short rationale for estimate: Widest path search with a heap followed by a BFS. With the
+    // forest in use the bottleneck weight is read from a walk in a tree, and only the BFS is
+    // left, so both ways return the same path.
     Path get_path_of_least_friction(AffiliationID source, AffiliationID target);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets a flag. The forest is built in O(e log(e)) on the
+    // next friction query after the connections have changed.
+    void use_friction_forest(bool enabled);
+
+    // Estimate of performance: O((n + e) log(n)), O(k log(k)) with the contraction hierarchy
+    // Short rationale for estimate: A* with a d-ary heap. The straight line distance to the target
+    // steers the search, so usually only a small part of the graph is settled. With an up to
+    // date hierarchy in use both ends search only upwards, k being the nodes above them.
     PathWithDist get_shortest_path(AffiliationID source, AffiliationID target);
 
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets a flag. The hierarchy is used while it is up to
+    // date, and get_shortest_path falls back to A* once the graph has changed.
+    void use_contraction_hierarchy(bool enabled);
+
+    // Estimate of performance: O(n d^2 w log(n)), d is the degree and w the witness limit
+    // Short rationale for estimate: Every node is contracted once, trying a bounded witness
+    // search for each pair of its neighbours. Only the copy of the connections is taken under
+    // the shared lock, so changes and queries go on during the build. The result is swapped
+    // in under the exclusive lock if the graph hasn't changed meanwhile.
+    void rebuild_contraction_hierarchy();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Compares versions. True if get_shortest_path would use the
+    // hierarchy.
+    bool contraction_hierarchy_ready();
+
+    // Estimate of performance: O(n log(n) + p log(p))
+    // Short rationale for estimate: Rows are added in one pass with the tables sized up front.
+    // The p affiliation pairs of the publications are sorted and counted once, and the sorted
+    // orders are rebuilt once at the end. Rows are applied in the order affiliations,
+    // publications, authorships, references, and a row the single add operation would
+    // refuse is skipped. Returns false if any row was skipped. Data whose tables have vectors
+    // of different lengths is refused as a whole, and nothing is loaded.
+    bool bulk_load(BulkData const& data);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets a flag. In concurrent mode queries run in parallel
+    // with each other under a shared lock. There is a single lock for the whole datastructure,
+    // so a change takes it exclusively and queries wait until the change is done; bulk_load
+    // holds it for the whole load. Writing the operation log to disk is done after the lock
+    // is released. The mode has to be set while no other thread uses the object. Visitors
+    // passed to the for_each operations run under the shared lock and must not call other
+    // operations of the datastructure.
+    void use_concurrent_mode(bool enabled);
+
+    // Estimate of performance: O(1) amortized
+    // Short rationale for estimate: The results of get_any_path, get_path_with_least_affiliations
+    // and get_shortest_path are cached until the graph changes. Sets the memory the cache may
+    // use in bytes, evicting the least recently used results if needed. 0 turns the cache off.
+    void set_path_cache_budget(size_t bytes);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Copies the counters. Hits and misses count the lookups
+    // of queries between two connected affiliations.
+    PathCacheStats get_path_cache_stats();
+
+    // Estimate of performance: O(n + p log(p) + e)
+    // Short rationale for estimate: Every affiliation, publication, reference and connection is
+    // written once into a versioned binary file, the publications sorted by year so that
+    // loading doesn't have to sort them. The image is written to path.tmp, synced and
+    // renamed over path, so a crash while saving leaves the previous snapshot in place.
+    // Returns false if the file can't be written.
+    bool save_snapshot(std::string const& path);
+
+    // Estimate of performance: O(n + p + e)
+    // Short rationale for estimate: The file is decoded in one pass into the in-memory tables,
+    // so loading takes time linear in the size of the file. The sorted orders are stored in
+    // the file and only checked; the grid is filled as the affiliations are read. The
+    // component index, friction forest and contraction hierarchy are left to be built when
+    // first needed, as after any change. Queries are not served lazily from the file: the
+    // whole snapshot is decoded before the first query. Returns false if the file isn't a
+    // snapshot of this version; a snapshot that turns out to be broken while loading leaves
+    // the datastructure empty. An open operation log is closed, since its records don't
+    // follow the loaded state.
+    bool load_snapshot(std::string const& path);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Opens the file for appending. From then on every successful
+    // change is recorded in it. Records are collected in memory and written and synced once
+    // they take group_bytes, before the change that filled the group returns. A change is
+    // durable only after that or after flush_log, so a crash loses the changes of the group
+    // being collected. With group_bytes 0 every change is synced before it returns. The log
+    // should be a new file or the one just passed to recover.
+    bool open_log(std::string const& path, size_t group_bytes = LOG_GROUP_BYTES);
+
+    // Estimate of performance: O(k), k is the size of the records not yet written
+    // Short rationale for estimate: Writes the pending group and syncs the file to disk. The
+    // changes made before the call are durable when it returns.
+    bool flush_log();
+
+    // Estimate of performance: O(n + p + e)
+    // Short rationale for estimate: Saves a snapshot as save_snapshot does and then empties
+    // the open log, since everything in it is in the snapshot. Recovery from the snapshot
+    // and the log then only replays the changes made after the checkpoint. Returns false,
+    // leaving the log as it was, if there is no open log or the snapshot can't be written.
+    bool checkpoint(std::string const& snapshot_path);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Flushes and closes the log.
+    void close_log();
+
+    // Estimate of performance: O(n + p + e + r), r is the size of the log
+    // Short rationale for estimate: Loads the snapshot, if there is one, and replays the records
+    // of the log written after it, reading the log a record at a time. A torn record at the
+    // end of the log and everything after it is cut off, so the log can be opened again for
+    // appending. Returns false if the snapshot can't be loaded or the log can't be cut. Should
+    // be called before other threads use the object.
+    bool recover(std::string const& snapshot_path, std::string const& log_path);
+
 
 private:
-    // Datastructure for affiliations
-    std::unordered_map<AffiliationID, Affiliation*> affiliations;
+    // Interned affiliation IDs and names. Titles are nearly all unique, so they aren't interned.
+    InternTable affiliation_ids;
+    InternTable names;
+
+    // Storage of the affiliations and publications
+    Slab<Affiliation> affiliation_storage;
+    Slab<Publication> publication_storage;
+
+    // Datastructure for affiliations, indexed by the interned ID. Removed
+    // affiliations are left as nullptr.
+    std::vector<Affiliation*> affiliations;
+    unsigned int affiliation_count = 0;
+
+    // Affiliations by their coordinates for get_affiliations_closest_to
+    SpatialGrid affiliation_grid;
+
+    // Affiliations by their exact coordinates for find_affiliation_with_coord
+    std::unordered_multimap<Coord, NodeID, CoordHash> affiliation_coords;
+
+    // Affiliations kept sorted by name and by distance from the origin
+    OrderedIndex affiliations_by_name;
+    OrderedIndex affiliations_by_distance;
+    std::vector<AffiliationID> to_ids(std::vector<NodeID> const& handles);
 
     // Datastructure for publications
     std::unordered_map<PublicationID, Publication*> publications;
 
-    std::unordered_map<AffiliationID, std::vector<Connection>> connections;
+    // Set when the depths and jump pointers of the publications no longer match
+    // the reference trees, they are rebuilt on the next ancestor query
+    bool lineage_stale = false;
+
+    // Preorder of the reference trees. The references of a publication, direct
+    // and indirect, follow it as one contiguous slice.
+    bool reference_layout_enabled = false;
+    bool reference_layout_stale = true;
+    std::vector<PublicationID> reference_layout;
+
+    // Connections between affiliations over the node indices
+    ConnectionGraph graph;
+
+    // Scratch space of the path searches. A search leases buffers from the pool
+    // for its duration, so searches running in different threads don't share them.
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<SearchBuffers>> spare_buffers;
+
+    struct BufferLease
+    {
+        Datastructures& owner;
+        std::unique_ptr<SearchBuffers> buffers;
+
+        explicit BufferLease(Datastructures& owner);
+        ~BufferLease();
+        BufferLease(const BufferLease&) = delete;
+        BufferLease& operator=(const BufferLease&) = delete;
+    };
+
+    // Concurrency: access_mutex is taken by the public operations only in concurrent
+    // mode. The lazy rebuilds done by queries hold rebuild_mutex, so only one query
+    // rebuilds and the others wait for the result. A change holds writer_gate while it
+    // waits for access_mutex and queries pass the gate first, so a steady stream of
+    // queries can't keep a change waiting forever.
+    bool concurrent_mode = false;
+    std::shared_mutex access_mutex;
+    std::mutex writer_gate;
+    std::mutex rebuild_mutex;
+
+    // Exclusive lock of a change. If the change filled a log group, the group is
+    // written when the lock goes out of scope, after access_mutex is released.
+    struct WriteLock
+    {
+        Datastructures& owner;
+        std::unique_lock<std::shared_mutex> lock;
+        // Set once the group is written and the lock released
+        bool released = false;
+
+        ~WriteLock();
+    };
+
+    std::shared_lock<std::shared_mutex> read_lock();
+    WriteLock write_lock();
+
+    // Maximum spanning forest of the connection weights. The smallest weight on a path in
+    // it is the bottleneck of the path of least friction, so the widest path search is skipped.
+    bool friction_forest_enabled = false;
+    bool friction_forest_stale = true;
+    std::vector<NodeID> forest_parent;
+    std::vector<Weight> forest_weight;
+    std::vector<unsigned int> forest_depth;
+
+    // Incremented on every change to the affiliations or their connections, so that
+    // a structure built from the graph can tell whether it is still up to date
+    unsigned long long graph_version = 0;
+
+    // Built only by rebuild_contraction_hierarchy, a change to the graph leaves it stale
+    bool hierarchy_enabled = false;
+    ContractionHierarchy hierarchy;
+
+    // Estimate of performance: O(k log(k))
+    // Short rationale for estimate: Bidirectional Dijkstra over the upward arcs, then the
+    // shortcuts on the path are unpacked. Returns false if the hierarchy doesn't match the
+    // graph, and the caller falls back to A*.
+    bool hierarchy_shortest_path(SearchBuffers& buffers, NodeID source_node, NodeID target_node, PathWithDist& path_with_dist);
+
+    // Results of the path queries. Queries running in parallel share the cache, so it
+    // has a mutex of its own.
+    std::mutex path_cache_mutex;
+    PathCache path_cache;
+
+    // Estimate of performance: O(k), k is the length of the path
+    // Short rationale for estimate: Copies a cached result out, returns false if there is none.
+    bool cached_path(PathCache::Query query, NodeID source_node, NodeID target_node, Path& path);
+    bool cached_path(NodeID source_node, NodeID target_node, PathWithDist& path);
+
+    // Estimate of performance: O(k) amortized
+    // Short rationale for estimate: Copies the result into the cache unless the cache is off.
+    void cache_path(PathCache::Query query, NodeID source_node, NodeID target_node, Path const& path);
+    void cache_path(NodeID source_node, NodeID target_node, PathWithDist const& path);
+
+    // Estimate of performance: O((n + e) log(n))
+    // Short rationale for estimate: A* search of get_shortest_path.
+    PathWithDist astar_shortest_path(SearchBuffers& buffers, NodeID source_node, NodeID target_node);
+
+    // Connected components of the graph. Added connections are united right away; a
+    // removal marks the index stale and the next query rebuilds it. Queries only read
+    // roots, so in concurrent mode they don't write into the index.
+    bool components_stale = true;
+    DisjointSets components;
+
+    // Estimate of performance: O(1), O(n + e) when stale
+    // Short rationale for estimate: Rebuilds the component index if needed, under rebuild_mutex.
+    void refresh_components();
+
+    // Estimate of performance: O(log(n))
+    // Short rationale for estimate: Root comparison, see same_component.
+    bool connected(NodeID aff1, NodeID aff2);
+
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Affiliations sharing a coordinate are in the same bucket.
+    void erase_affiliation_coord(Coord xy, NodeID id);
 
     // Find pointer functions for affiliations and publications
 
@@ -302,17 +1167,152 @@ private:
     // However, it is constant on average
     Publication* is_publication(PublicationID id);
 
-    void add_connection(AffiliationID aff1, AffiliationID aff2);
-    void add_connections(const std::vector<AffiliationID>& affiliations);
-    bool has_connection(AffiliationID aff1, AffiliationID aff2);
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: add_reference without taking the lock.
+    bool link_reference(PublicationID id, PublicationID parentid);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Reads the jump pointers of the referencer.
+    void link_lineage(Publication* pub);
 
-    Connection search_inverted_connection(Connection connection);
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Every reference tree is walked once from its root.
+    void rebuild_lineage();
+
+    // Estimate of performance: O(log(d))
+    // Short rationale for estimate: Both publications move up by jumps when the jumps differ.
+    Publication* common_ancestor(Publication* pub1, Publication* pub2);
 
-    void find_any_path(AffiliationID current, AffiliationID target,
-                                                std::set<AffiliationID>& visited, Path& path);
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Every reference tree is walked once in preorder.
+    void build_reference_layout();
 
-    bool compare_connection_affs(const Connection& c1, const Connection& c2);
-    bool compare_connection_affs_inverted(const Connection& c1, const Connection& c2);
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: clear_all without taking the lock.
+    void clear_data();
+
+    // Estimate of performance: O(n + p + e)
+    // Short rationale for estimate: Encodes the snapshot written by save_snapshot.
+    std::string snapshot_image();
+
+    // Estimate of performance: O(n log(n) + p + e)
+    // Short rationale for estimate: Parses a snapshot image, see load_snapshot.
+    bool load_image(const char* begin, size_t size);
+
+    // Operation log. The records are framed by their length and a checksum, and numbered
+    // by log_lsn. A snapshot stores the number of the last change it contains.
+    enum class LogOp : unsigned char {
+        clear_all, add_affiliation, change_affiliation_coord, add_publication, add_reference,
+        add_affiliation_to_publication, remove_affiliation, remove_publication, bulk_load
+    };
+    static constexpr size_t LOG_GROUP_BYTES = 1 << 16;
+    // Records are framed by a 32-bit length, a longer record is refused
+    static constexpr size_t MAX_LOG_RECORD_BYTES = std::numeric_limits<unsigned int>::max();
+    std::FILE* log_file = nullptr;
+    std::string log_path;
+    size_t log_group_bytes = LOG_GROUP_BYTES;
+    std::string log_buffer;
+    unsigned long long log_lsn = 0;
+    // Set when log_buffer has grown to a full group
+    bool log_group_full = false;
+    // Every group taken from log_buffer gets the next turn under the exclusive lock, so
+    // the turns follow the LSNs. A group is written once the turns before it are done,
+    // waiting without the exclusive lock. log_groups_written is guarded by log_mutex.
+    unsigned long long log_groups_taken = 0;
+    unsigned long long log_groups_written = 0;
+    std::mutex log_mutex;
+    std::condition_variable log_turn;
+
+    // Estimate of performance: O(s), s is the size of the fields
+    // Short rationale for estimate: Appends one record to the pending group. Does nothing
+    // when no log is open. Returns false if the record is too long to be framed.
+    template <typename... Fields>
+    bool log_operation(LogOp op, Fields const&... fields);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Takes the pending group, releases the exclusive lock and
+    // then writes and syncs the group in its turn.
+    bool write_log_group(WriteLock& lock);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Waits until the groups taken before the given turn are
+    // written. Returns log_mutex locked.
+    std::unique_lock<std::mutex> wait_log_turn(unsigned long long turn);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Ends the turn held with log_mutex and wakes the next one.
+    void end_log_turn(std::unique_lock<std::mutex>& writing);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Writes and syncs a group, log_mutex has to be held.
+    bool write_log_records(std::string const& group);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: close_log without taking the lock.
+    void detach_log();
+
+    // Estimate of performance: As the operation recorded
+    // Short rationale for estimate: Decodes the fields and calls the operation. Returns false
+    // if the record is malformed.
+    bool replay_record(LogOp op, SnapshotReader& in);
+
+    // Pairs per thread below which count_connections doesn't start another thread
+    static constexpr size_t MIN_PAIRS_PER_THREAD = 1 << 16;
+
+    // Estimate of performance: O(p log(p) / t + e log(t))
+    // Short rationale for estimate: The p pairs are emitted and sorted in t threads, each
+    // thread owning a part of the pairs, and the t sorted results are merged.
+    std::vector<GraphEdge> count_connections(std::vector<std::pair<Publication*, unsigned int>> const& sources);
+
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Hash lookups and inserts, the sorted orders are left to the caller.
+    Affiliation* create_affiliation(AffiliationID const& id, Name const& name, Coord xy);
+
+    // Estimate of performance: O(1) on average, O(n) worst case
+    // Short rationale for estimate: Hash lookup and insert.
+    Publication* create_publication(PublicationID id, Name const& name, Year year);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Binary search, then the insert shifts the later publications.
+    void insert_publication(Affiliation* aff, Publication* pub);
+
+    void add_connection(NodeID aff1, NodeID aff2);
+    void add_connections(const std::vector<NodeID>& affiliations);
+
+    // Estimate of performance: O(k^2) amortized, k is the number of affiliations
+    // Short rationale for estimate: Undoes add_connections, every pair is a hash lookup.
+    void remove_connections(const std::vector<NodeID>& affiliations);
+    bool has_connection(AffiliationID aff1, AffiliationID aff2);
+
+    // Estimate of performance: O(n + e)
+    // Short rationale for estimate: Iterative DFS, every affiliation and connection is visited at most once.
+    Path find_any_path(SearchBuffers& buffers, NodeID source_node, NodeID target_node);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Buffers are only resized when the graph has grown.
+    void prepare_buffers(SearchBuffers& buffers);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Follows the parent links of both searches, k is the path length.
+    Path build_path(SearchBuffers& buffers, NodeID meet);
+
+    // Estimate of performance: O(n + e)
+    // Short rationale for estimate: Bidirectional BFS, connections lighter than min_weight are skipped.
+    NodeID search_least_affiliations(SearchBuffers& buffers, NodeID source_node, NodeID target_node, Weight min_weight);
+
+    // Estimate of performance: O(e log(e))
+    // Short rationale for estimate: Connections are sorted for Kruskal, union-find is nearly constant.
+    void build_friction_forest();
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Climbs the tree from both ends, k is the length of the path.
+    // Returns NO_WEIGHT if the ends are in different trees.
+    Weight friction_forest_bottleneck(NodeID source_node, NodeID target_node);
+
+    // Estimate of performance: O((n + e) log(n))
+    // Short rationale for estimate: Widest path search with a heap, each node is settled once.
+    // Returns NO_WEIGHT if there is no path.
+    Weight widest_path_bottleneck(SearchBuffers& buffers, NodeID source_node, NodeID target_node);
 };
 
 #endif // DATASTRUCTURES_HH